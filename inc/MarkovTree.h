@@ -8,6 +8,32 @@
 
 namespace HeteroSampler {
   struct Model; 
+  struct Tile;
+  struct LockstepChains;
+
+  /* training chain of the learned stop rule, see Policy::trainStop:
+   * instance-level meta-features at the end of each sweep, and the score of the labels then. */
+  struct StopTrace {
+  public:
+    std::vector<FeaturePointer> feat;
+    std::vector<double> score;
+  };
+
+  /* online convergence statistics of a chain and its auxiliary chains.
+   * the per-sweep log-score of each chain feeds Welford estimators,
+   * from which the Gelman-Rubin R-hat is computed. */
+  struct ChainDiagnostics {
+  public:
+    ChainDiagnostics(size_t num_chains);
+    void add(size_t k, double x);   // add the log-score of chain <k> after a sweep.
+    double rhat() const;            // potential scale reduction factor.
+
+    std::vector<std::shared_ptr<GraphicalModel> > aux;  // auxiliary chains.
+    std::vector<double> aux_log_weight;                  // running log-score of auxiliary chains.
+    std::shared_ptr<LockstepChains> lockstep;            // auxiliary chains in lockstep, replaces aux.
+    std::vector<size_t> count;
+    std::vector<double> mean, m2;
+  };
   
   /* warning: this class is not thread safe */
   struct MarkovTreeNode {
@@ -27,20 +53,60 @@ namespace HeteroSampler {
     double log_prior_weight;  // prior weight from proposal.
     double max_log_prior_weight;
     std::shared_ptr<GraphicalModel> max_gm;  // save gm with maximum score.
+    /* lean sampling (Policy::lean): max_gm is built on demand. if max_stale, the best sample is
+     * gm with the (position, old label) steps of max_undo undone, newest first. */
+    bool max_stale;
+    std::vector<std::pair<int, int> > max_undo;
 
 
     int depth;                // how many samples have been generated.
+    size_t restarts;          // how often depth was reset to 0 by a new run of the chain.
     Location choice;               // if using a policy, which choice is made?
     size_t time_stamp;        // time stamp of this object.
     std::weak_ptr<MarkovTreeNode> parent; // weak_ptr: avoid cycle in reference count.
     std::vector<std::shared_ptr<MarkovTreeNode> > children;
     FeaturePointer stop_feat;            
-    bool compute_stop;
+    bool compute_stop;       // whether stop_feat and resp were computed for this node.
     double resp;             // response for stop or not prediction.
+    std::shared_ptr<StopTrace> stop_trace;  // set on training chains of the stop rule.
+
+    /* per-sweep convergence signals, see GibbsPolicy::converged */
+    int sweep;                // how many sweeps have been completed.
+    int sweep_changes;        // labels changed during the current sweep.
+    double sweep_ent_change;  // sum of |entropy change| during the current sweep.
+    int stop_sweep;           // sweep at which the chain converged, -1 if it has not.
+    std::shared_ptr<ChainDiagnostics> diag;  // R-hat statistics, only if K > 1.
+
+    /* asynchronous (hogwild) sampling: how many neighbor labels read
+     * before a step had changed by the time the step was written. */
+    size_t stale_reads, blanket_reads;
+
+    /* chromatic / hogwild sampling: one random stream per parallel job of this chain,
+     * so chains sampled at the same time never share a generator. */
+    std::vector<objcokus> job_rngs;
+    /* hogwild sampling: one replica of gm per job, kept across calls. */
+    std::vector<std::shared_ptr<GraphicalModel> > job_replicas;
+
+    /* tiled sampling: chains on rectangular tiles of the instance, see Tile. */
+    std::vector<std::shared_ptr<Tile> > tiles;
   };
 
   typedef std::shared_ptr<MarkovTreeNode> MarkovTreeNodePtr;
 
+  /* a rectangular tile of an image, sampled as a chain on its own crop.
+   * the crop has a one pixel halo owned by neighboring tiles, whose labels
+   * are refreshed from the full image at synchronization points. */
+  struct Tile {
+  public:
+    ptr<Instance> instance;           // the crop, referenced by node->gm.
+    std::shared_ptr<MarkovTreeNode> node;
+    std::vector<int> interior, halo;  // crop positions owned by this / neighboring tiles.
+    std::vector<int> global;          // crop position -> position in the full image.
+    Heap heap;                        // adaptive policy: responses of interior positions.
+    double budget;                    // adaptive policy: samples granted but not yet taken.
+    objcokus rng;
+  };
+
   static std::shared_ptr<MarkovTreeNode> makeMarkovTreeNode(std::shared_ptr<MarkovTreeNode> parent) {
     return std::shared_ptr<MarkovTreeNode>(new MarkovTreeNode(parent));
   }
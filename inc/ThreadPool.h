@@ -5,6 +5,9 @@
 #include <thread>
 #include <chrono>
 #include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <mutex>
 
 static long getFingerPrint(long iterations, long startSeed) { // random hash function taken from 6.816.
   const long m = (long) 0xFFFFFFFFFFFFL;
@@ -17,21 +20,39 @@ static long getFingerPrint(long iterations, long startSeed) { // random hash fun
   return ( seed >> 12 );
 }
 
-// ThreadPool using consumer-producer model.
+// ThreadPool with one work deque per thread and work stealing.
 // each thread has a unique id, RNG and log.
 // type of work is T.
+// work from outside the pool is dealt round-robin to the back of the deques, a single work added
+// by a worker goes to the front of its own deque. a thread pops its own deque from the
+// front, so outside work runs in order, and steals from the back of the others.
+// at most <capacity> works are pending (0 = unbounded): producers outside the pool
+// wait for space, workers adding work never block.
 template<class T>
 class ThreadPool {
 public:
   // constructor.
-  ThreadPool(size_t num_threads, std::function<void(int, const T&)> worker);
+  ThreadPool(size_t num_threads, std::function<void(int, const T&)> worker, size_t capacity = 0);
   ~ThreadPool();
   // return number of threads in the pool.
   size_t numThreads() const {return this->th.size(); }
+  // return max number of pending works, 0 = unbounded.
+  size_t capacity() const {return this->th_capacity; }
   // add work (type T) to the thread pool.
   void addWork(const T& work);
-  // wait a quescent moment when there is no active work.
+  // add work to the back of the deque of thread <tid>, other threads may still steal it.
+  void addWorkTo(size_t tid, const T& work);
+  // add works in [begin, end), dealt round-robin over the deques, locking each deque once.
+  template<class Iter>
+  void addWork(Iter begin, Iter end);
+  // wait a quescent moment when there is no active work. not to be called by a worker.
   void waitFinish();
+  // run one pending work if the caller is a worker of this pool, return false if none ran.
+  bool help();
+  // id of the calling thread in this pool, -1 if it is not a worker.
+  int currentWorker() const {return tl_pool == this ? tl_tid : -1; }
+  // native handle of thread <tid>, e.g. to set its affinity.
+  std::thread::native_handle_type nativeHandle(size_t tid) {return th[tid]->native_handle(); }
   // lock.
   void lock();
   // unlock.
@@ -40,22 +61,45 @@ public:
 
   std::vector<objcokus> rngs;
 private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<T> work;
+  };
   void initThreads(size_t num_threads);
+  void push(size_t qid, const T& work, bool front);
+  void wakeup(size_t count);
+  size_t waitSpace();
+  bool pop(int tid, T& work);
+  void run(int tid, const T& work);
   std::vector<std::shared_ptr<std::thread> > th;
-  std::list<T> th_work;
-  size_t active_work;
-  std::mutex th_mutex;
-  std::condition_variable th_cv, th_finished;
+  std::vector<std::shared_ptr<Queue> > th_queue;
+  std::atomic<size_t> pending,     // works queued.
+                      unfinished,  // works queued or running.
+                      sleeping,    // threads waiting for work.
+                      next_queue;  // round-robin deque for producers outside the pool.
+  const size_t th_capacity;
+  std::mutex th_mutex, th_user_mutex;
+  std::condition_variable th_cv, th_finished, th_space;
   std::vector<std::shared_ptr<std::stringstream> > th_stream;
   std::vector<std::shared_ptr<XMLlog> > th_log;
 
-  bool is_stopped;
+  bool is_stopped;  // guarded by th_mutex.
+
+  static thread_local const ThreadPool<T>* tl_pool;
+  static thread_local int tl_tid;
 };
 
+template<class T>
+thread_local const ThreadPool<T>* ThreadPool<T>::tl_pool = nullptr;
 
 template<class T>
-ThreadPool<T>::ThreadPool(size_t num_threads, std::function<void(int, const T&)> worker)
-:worker(worker), is_stopped(false) {
+thread_local int ThreadPool<T>::tl_tid = -1;
+
+
+template<class T>
+ThreadPool<T>::ThreadPool(size_t num_threads, std::function<void(int, const T&)> worker, size_t capacity)
+:worker(worker), pending(0), unfinished(0), sleeping(0), next_queue(0),
+ th_capacity(capacity), is_stopped(false) {
   this->initThreads(num_threads);
 }
 
@@ -63,12 +107,11 @@ template<class T>
 ThreadPool<T>::~ThreadPool() {
   std::unique_lock<std::mutex> lock(th_mutex);
   is_stopped = true;
-  active_work = th.size();
-  lock.unlock(); 
+  lock.unlock();
   th_cv.notify_all();
-  waitFinish();
+  th_space.notify_all();
   for(std::shared_ptr<std::thread>& t : this->th) {
-    t->detach();  // must detach before delete according to c++ 11.
+    t->join();  // threads drain the pending works before they return.
     t = nullptr;
   }
 }
@@ -77,63 +120,227 @@ template<class T>
 void ThreadPool<T>::initThreads(size_t num_threads) {
   th.resize(num_threads);
   this->rngs.resize(num_threads);
-  active_work = 0;
   for(size_t ni = 0; ni < num_threads; ni++) {
     this->rngs[ni].seedMT(getFingerPrint(10, ni+1));
     this->th_stream.push_back(std::shared_ptr<std::stringstream>(new std::stringstream()));
     this->th_log.push_back(std::shared_ptr<XMLlog>(new XMLlog(*th_stream.back())));
+    this->th_queue.push_back(std::make_shared<Queue>());
+  }
+  for(size_t ni = 0; ni < num_threads; ni++) {
     this->th[ni] = std::shared_ptr<std::thread>(new std::thread([&] (int tid) {
-      std::unique_lock<std::mutex> lock(th_mutex);
+      tl_pool = this;
+      tl_tid = tid;
+      T work;
       while(true) {
-	if(is_stopped) {
-	  active_work-=1;
-	  th_finished.notify_all();
-	  lock.unlock();
-	  return;
-	}
-	if(th_work.size() > 0) {
-	  T work = th_work.front();
-	  th_work.pop_front();
-	  active_work = active_work+1;
-	  lock.unlock();
-	  th_stream[tid]->str("");
-	  worker(tid,  work);
-	  lock.lock();
-	  active_work = active_work-1;
-	  th_finished.notify_all();
-	}else{
-	  th_cv.wait(lock);	
+	if(this->pop(tid, work)) {
+	  this->run(tid, work);
+	  continue;
 	}
+	std::unique_lock<std::mutex> lock(th_mutex);
+	sleeping++;
+	while(!is_stopped and pending == 0) th_cv.wait(lock);
+	sleeping--;
+	if(is_stopped and pending == 0) return;
       }
     }, ni));
   }
 }
 
 template<class T>
-void ThreadPool<T>::addWork(const T& work) {
+void ThreadPool<T>::push(size_t qid, const T& work, bool front) {
+  Queue& queue = *th_queue[qid];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if(front) {
+    queue.work.push_front(work);
+  }else{
+    queue.work.push_back(work);
+  }
+  unfinished++;
+  pending++;
+}
+
+template<class T>
+void ThreadPool<T>::wakeup(size_t count) {
+  // pending is raised before sleeping is read, and a thread raises sleeping before
+  // it reads pending, so either it sees the work or it is notified here.
+  if(sleeping == 0) return;
+  std::lock_guard<std::mutex> lock(th_mutex);
+  if(count >= th.size()) {
+    th_cv.notify_all();
+  }else{
+    for(size_t i = 0; i < count; i++) th_cv.notify_one();
+  }
+}
+
+template<class T>
+size_t ThreadPool<T>::waitSpace() {  // return the free room, (size_t)-1 if unbounded.
+  if(th_capacity == 0 or currentWorker() >= 0) return (size_t)-1;
   std::unique_lock<std::mutex> lock(th_mutex);
-  this->th_work.push_back(work); 
-  lock.unlock(); 
-  th_cv.notify_all();
+  while(!is_stopped and pending >= th_capacity) th_space.wait(lock);
+  return pending < th_capacity ? th_capacity - pending : 1;
+}
+
+template<class T>
+bool ThreadPool<T>::pop(int tid, T& work) {
+  for(size_t k = 0; k < th_queue.size(); k++) {
+    Queue& queue = *th_queue[(tid + k) % th_queue.size()];
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if(queue.work.size() == 0) continue;
+    if(k == 0) {
+      work = queue.work.front();
+      queue.work.pop_front();
+    }else{  // steal.
+      work = queue.work.back();
+      queue.work.pop_back();
+    }
+    lock.unlock();
+    if(pending-- == th_capacity) {
+      std::lock_guard<std::mutex> lock(th_mutex);
+      th_space.notify_all();
+    }
+    return true;
+  }
+  return false;
+}
+
+template<class T>
+void ThreadPool<T>::run(int tid, const T& work) {
+  th_stream[tid]->str("");
+  worker(tid,  work);
+  if(--unfinished == 0) {
+    std::lock_guard<std::mutex> lock(th_mutex);
+    th_finished.notify_all();
+  }
+}
+
+template<class T>
+void ThreadPool<T>::addWork(const T& work) {
+  this->waitSpace();
+  int tid = currentWorker();
+  if(tid >= 0) {
+    this->push(tid, work, true);
+  }else{
+    this->push(next_queue++ % th_queue.size(), work, false);
+  }
+  this->wakeup(1);
+}
+
+template<class T>
+void ThreadPool<T>::addWorkTo(size_t tid, const T& work) {
+  this->waitSpace();
+  this->push(tid % th_queue.size(), work, false);
+  this->wakeup(th.size());  // the owner may not be the thread woken first.
+}
+
+template<class T>
+template<class Iter>
+void ThreadPool<T>::addWork(Iter begin, Iter end) {
+  std::vector<T> works(begin, end);
+  size_t num_queues = th_queue.size();
+  for(size_t lo = 0, hi; lo < works.size(); lo = hi) {
+    size_t room = this->waitSpace(), start = next_queue;  // a block only fills the free room.
+    hi = lo + std::min(room, works.size() - lo);
+    for(size_t q = 0; q < num_queues and lo + q < hi; q++) {
+      Queue& queue = *th_queue[(start + q) % num_queues];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      for(size_t i = lo + q; i < hi; i += num_queues) {
+        queue.work.push_back(works[i]);
+        unfinished++;
+        pending++;
+      }
+    }
+    next_queue += hi - lo;
+    this->wakeup(hi - lo);
+  }
 }
 
 template<class T>
 void ThreadPool<T>::waitFinish() {
   std::unique_lock<std::mutex> lock(th_mutex);
-  while(true) {
-    if(active_work + th_work.size() == 0) break;
-    th_finished.wait(lock);
-  }
-  lock.unlock();
+  while(unfinished > 0) th_finished.wait(lock);
+}
+
+template<class T>
+bool ThreadPool<T>::help() {
+  int tid = currentWorker();
+  T work;
+  if(tid < 0 or !this->pop(tid, work)) return false;
+  this->run(tid, work);
+  return true;
 }
 
 template<class T>
 void ThreadPool<T>::lock() {
-  th_mutex.lock();
+  th_user_mutex.lock();
 }
 
 template<class T>
 void ThreadPool<T>::unlock() {
-  th_mutex.unlock();
+  th_user_mutex.unlock();
+}
+
+
+// pool whose works are jobs called with the id of the thread running them.
+typedef ThreadPool<std::function<void(int)> > JobPool;
+
+inline static std::shared_ptr<JobPool> makeJobPool(size_t num_threads, size_t capacity = 0) {
+  return std::make_shared<JobPool>(num_threads,
+                                   [] (int tid, const std::function<void(int)>& job) {
+                                     job(tid);
+                                   }, capacity);
+}
+
+// call body(tid, i) for i in [begin, end), <grain> indices per job, and wait for them.
+// a worker of <pool> helps with pending jobs while it waits, so calls may nest.
+inline static void parallel_for(JobPool& pool, size_t begin, size_t end,
+                                const std::function<void(int, size_t)>& body, size_t grain = 1) {
+  if(begin >= end) return;
+  if(grain == 0) grain = 1;
+  struct Latch {
+    size_t remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+  auto latch = std::make_shared<Latch>();
+  latch->remaining = (end - begin + grain - 1) / grain;
+  std::vector<std::function<void(int)> > jobs;
+  for(size_t lo = begin; lo < end; lo += grain) {
+    size_t hi = std::min(lo + grain, end);
+    jobs.push_back([&body, latch, lo, hi] (int tid) {
+      for(size_t i = lo; i < hi; i++) body(tid, i);
+      std::lock_guard<std::mutex> lock(latch->mutex);
+      if(--latch->remaining == 0) latch->done.notify_all();
+    });
+  }
+  pool.addWork(jobs.begin(), jobs.end());
+  if(pool.currentWorker() >= 0) {
+    while(true) {
+      {
+        std::lock_guard<std::mutex> lock(latch->mutex);
+        if(latch->remaining == 0) break;
+      }
+      if(!pool.help()) std::this_thread::yield();
+    }
+  }else{
+    std::unique_lock<std::mutex> lock(latch->mutex);
+    while(latch->remaining > 0) latch->done.wait(lock);
+  }
+}
+
+// reduce map(tid, i) over i in [begin, end) with reduce(a, b), <grain> indices per job.
+// <init> must be the identity of reduce. partial results are combined in index order.
+template<class R, class Map, class Reduce>
+R parallel_reduce(JobPool& pool, size_t begin, size_t end, R init,
+                  Map map, Reduce reduce, size_t grain = 1) {
+  if(begin >= end) return init;
+  if(grain == 0) grain = 1;
+  std::vector<R> partial((end - begin + grain - 1) / grain, init);
+  parallel_for(pool, 0, partial.size(), [&] (int tid, size_t c) {
+    size_t lo = begin + c * grain, hi = std::min(lo + grain, end);
+    for(size_t i = lo; i < hi; i++) partial[c] = reduce(partial[c], map(tid, i));
+  });
+  R ret = init;
+  for(const R& r : partial) ret = reduce(ret, r);
+  return ret;
 }
 #endif
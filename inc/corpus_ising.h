@@ -61,6 +61,25 @@ public:
   int ptToPos(const Pt& pt) const {
     return pt.w * H + pt.h;
   }
+
+  /* sub-image of rows [h0, h1) and columns [w0, w1), sharing tokens with this image */
+  ptr<ImageIsing> crop(int h0, int w0, int h1, int w1) const {
+    auto image = std::make_shared<ImageIsing>(this->corpus);
+    image->H = h1 - h0;
+    image->W = w1 - w0;
+    for(int h = h0; h < h1; h++) {
+      image->img.push_back(vec<int>(img[h].begin() + w0, img[h].begin() + w1));
+      image->img_gt.push_back(vec<int>(img_gt[h].begin() + w0, img_gt[h].begin() + w1));
+    }
+    for(int w = w0; w < w1; w++) { // fortran style.
+      for(int h = h0; h < h1; h++) {
+        int pos = ptToPos(Pt(h, w));
+        image->seq.push_back(seq[pos]);
+        if((size_t)pos < tag.size()) image->tag.push_back(tag[pos]);
+      }
+    }
+    return image;
+  }
 };
 
 struct CorpusIsing : public Corpus {
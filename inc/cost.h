@@ -0,0 +1,74 @@
+#ifndef HETEROSAMPLER_COST
+#define HETEROSAMPLER_COST
+
+#include "utils.h"
+#include <chrono>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace HeteroSampler {
+  // cheap cycle counter: the time stamp counter on x86, steady_clock ticks elsewhere.
+  inline static uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  // seconds per unit of readCycles, calibrated once against steady_clock.
+  inline static double secondsPerCycle() {
+    static const double rate = [] () {
+      auto t0 = std::chrono::steady_clock::now();
+      uint64_t c0 = readCycles();
+      while (std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(2)) {}
+      uint64_t c1 = readCycles();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      return c1 > c0 ? seconds / (c1 - c0) : 1e-9;
+    }();
+    return rate;
+  }
+
+  /* online estimate of the CPU cost (seconds) of a kernel, smoothed over classes of positions
+   * (e.g. by degree): an exponential moving average per class, the mean of all
+   * measurements for classes not seen yet. */
+  class CostModel {
+  public:
+    CostModel(double smoothing = 0.1, size_t num_classes = 32)
+    :smoothing(smoothing), cls_cost(num_classes, 0), cls_count(num_classes, 0), total(0), n(0) {}
+
+    // class of a position with <degree> neighbours.
+    size_t classOf(size_t degree) const {return std::min(degree, cls_cost.size() - 1); }
+
+    void add(size_t cls, double seconds) {
+      cls_cost[cls] = cls_count[cls] == 0 ? seconds : smooth(cls_cost[cls], seconds);
+      cls_count[cls]++;
+      total += seconds;
+      n++;
+    }
+
+    // moving average of <estimate> after measuring <seconds>, 0 = not measured yet.
+    double smooth(double estimate, double seconds) const {
+      if (estimate <= 0) return seconds;
+      return (1 - smoothing) * estimate + smoothing * seconds;
+    }
+
+    double estimate(size_t cls) const {
+      return cls_count[cls] > 0 ? cls_cost[cls] : this->mean();
+    }
+
+    double mean() const {return n > 0 ? total / n : 0; }
+    size_t count() const {return n; }
+
+  private:
+    double smoothing;
+    vec<double> cls_cost;
+    vec<size_t> cls_count;
+    double total;
+    size_t n;
+  };
+}
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "utils.h"
 #include "corpus.h"
+#include "heap.h"
 
 namespace HeteroSampler {
 
@@ -43,7 +44,7 @@ struct compare_value {
   }
 };
 
-typedef boost::heap::fibonacci_heap<Value, boost::heap::compare<compare_value>> Heap;
+typedef IndexedHeap<Value, compare_value> Heap;
 
 struct GraphicalModel {
 public:
@@ -61,8 +62,12 @@ public:
     blanket.resize(this->size());
     changed.resize(this->size());
     vary.resize(this->size());
-    handle.resize(this->size());
+    handle.resize(this->size(), Heap::npos);
+    cost.resize(this->size(), 0);
+    stable.resize(this->size(), 0);
     feat.resize(this->size(), nullptr);
+    meta_stride = 0;
+    discord_stride = 0;
 
     sc.resize(num_tags, 0);
     prev_sc.resize(this->size());
@@ -78,6 +83,37 @@ public:
     time = 0;
   }
 
+  /* copy the sampling statistics of <id> from <gm>, a replica of this model. */
+  void copyStats(const GraphicalModel& gm, int id) {
+    copyStats(gm, id, id);
+  }
+
+  /* copy the sampling statistics of <from> in <gm> to <id> of this model. */
+  void copyStats(const GraphicalModel& gm, int from, int id) {
+    oldlabels[id] = gm.oldlabels[from];
+    timestamp[id] = gm.timestamp[from];
+    entropy[id] = gm.entropy[from];
+    prev_entropy[id] = gm.prev_entropy[from];
+    this_sc[id] = gm.this_sc[from];
+    prev_sc[id] = gm.prev_sc[from];
+    reward[id] = gm.reward[from];
+  }
+
+  /* add the normalized conditional <logprob> of <id> to its running marginal.
+   * marginals are allocated on first use, so models that never decode from them pay nothing. */
+  void accumulateMarginal(int id, const vec<double>& logprob) {
+    if (marginal.size() != this->size()) {
+      marginal.resize(this->size());
+    }
+    vec<double>& m = marginal[id];
+    if (m.size() != logprob.size()) {
+      m.resize(logprob.size(), 0);
+    }
+    for (size_t t = 0; t < logprob.size(); t++) {
+      m[t] += exp(logprob[t]);
+    }
+  }
+
   int time;                               // how many times have spent on sampling this graphical model.
   int oldval;                             // oldval before the latest sampling.
   vec<int> oldlabels;                     // old labels.
@@ -86,16 +122,33 @@ public:
   std::vector<double> prev_entropy;       // previous entropy before being sampled.
   std::vector<double> sc;                 // temporary normalized score.
   vec<vec<double> > this_sc, prev_sc;     // normalized score.
+  vec<vec<double> > marginal;             // sum of conditionals seen at each position (Rao-Blackwellized).
   std::vector<double> entropy_unigram;    // unigram entropy of positions.
   vec<vec<double> > sc_unigram;
   std::vector<double> reward;
   std::vector<double> resp;
   std::vector<int> mask;
+  std::vector<double> cost;                // smoothed seconds to sample a position, 0 = not measured.
+  std::vector<int> stable;                 // consecutive visits with stable entropy and blanket.
   vec<map<int, int> > blanket;             // Markov blanket.
   vec<map<int, bool> > changed;            // whether a location has changed.
   vec<map<int, int> > vary;                // how many times a neighbor has varied.
-  vec<typename Heap::handle_type> handle;
-  std::vector<FeaturePointer> feat;
+  vec<vec<int> > colors;                   // colour classes of positions, see Model::colorGraph.
+  vec<Heap::handle_type> handle;          // handle in the policy heap, Heap::npos if not in one.
+  std::vector<FeaturePointer> feat;         // meta-features keyed by value, e.g. "3-cond-ent".
+  std::vector<double> meta;                // dense meta-features, meta_stride per position.
+  size_t meta_stride;
+
+  double* metaRow(int id) {return &meta[id * meta_stride]; }
+  const double* metaRow(int id) const {return &meta[id * meta_stride]; }
+
+  // nb-discord counts: row <id> counts the labels its neighbours left, one slot per label.
+  // the label of <id> itself is fixed between two extractions of its meta-features.
+  std::vector<double> discord;
+  size_t discord_stride;
+
+  double* discordRow(int id) {return &discord[id * discord_stride]; }
+  const double* discordRow(int id) const {return &discord[id * discord_stride]; }
 
   /* randomness */
   objcokus* rng;
@@ -0,0 +1,153 @@
+#ifndef HETEROSAMPLER_HEAP
+#define HETEROSAMPLER_HEAP
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
+
+namespace HeteroSampler {
+  /* max-heap of D-ary nodes stored in one array.
+   * push returns a handle that stays valid for the lifetime of the heap; values are stored
+   * by handle and the heap array only holds handles, with a handle-to-slot index so a value
+   * can be changed in place. equal values are ordered by handle, i.e. by push order.
+   * an erased handle keeps its value and can be restored; updates to it only take effect then. */
+  template<class T, class Compare, size_t D = 4>
+  class IndexedHeap {
+  public:
+    typedef size_t handle_type;
+    static const handle_type npos = (handle_type)-1;
+
+    bool empty() const {return heap.empty(); }
+    size_t size() const {return heap.size(); }
+    // number of erased handles.
+    size_t erased() const {return values.size() - heap.size(); }
+    // whether <h> was pushed to this heap, erased or not.
+    bool contains(handle_type h) const {return h < slot.size(); }
+    bool active(handle_type h) const {return slot[h] != npos; }
+
+    handle_type push(const T& value) {
+      handle_type h = values.size();
+      values.push_back(value);
+      heap.push_back(h);
+      slot.push_back(heap.size() - 1);
+      siftUp(heap.size() - 1);
+      return h;
+    }
+
+    const T& top() const {return values[heap[0]]; }
+
+    // value of <h>. after changing it, call update(h), or update_many with a batch of handles.
+    T& operator[](handle_type h) {return values[h]; }
+    const T& operator[](handle_type h) const {return values[h]; }
+
+    // restore the order after the value of <h> changed.
+    void update(handle_type h) {
+      if(!active(h)) return;
+      siftUp(slot[h]);
+      siftDown(slot[h]);
+    }
+
+    // take <h> out of the order, top() will not return it until it is restored.
+    void erase(handle_type h) {
+      size_t i = slot[h];
+      if(i == npos) return;
+      handle_type last = heap.back();
+      heap.pop_back();
+      slot[h] = npos;
+      if(i < heap.size()) {
+        place(i, last);
+        update(last);
+      }
+    }
+
+    // put an erased <h> back with its current value.
+    void restore(handle_type h) {
+      if(active(h)) return;
+      heap.push_back(h);
+      slot[h] = heap.size() - 1;
+      siftUp(heap.size() - 1);
+    }
+
+    // restore the order after the values of the handles in [begin, end) changed.
+    // repeated handles are fixed once. the ancestors of the changed slots are sifted down
+    // bottom-up, as in building a heap, or the whole heap is rebuilt if that touches less.
+    template<class Iter>
+    void update_many(Iter begin, Iter end) {
+      if(begin == end) return;
+      if(std::next(begin) == end) {
+        update(*begin);
+        return;
+      }
+      dirty.clear();
+      for(Iter it = begin; it != end; ++it) {
+        if(!active(*it)) continue;
+        for(size_t i = slot[*it]; ; i = (i - 1) / D) {
+          dirty.push_back(i);
+          if(i == 0) break;
+        }
+      }
+      std::sort(dirty.begin(), dirty.end());
+      dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+      if(dirty.size() * 2 > heap.size()) {
+        for(size_t i = heap.size() / D + 1; i-- > 0; ) siftDown(i);
+        return;
+      }
+      for(size_t k = dirty.size(); k-- > 0; ) siftDown(dirty[k]);
+    }
+
+  private:
+    // whether handle <a> belongs above handle <b>.
+    bool above(handle_type a, handle_type b) const {
+      if(less(values[b], values[a])) return true;
+      if(less(values[a], values[b])) return false;
+      return a < b;
+    }
+
+    void place(size_t i, handle_type h) {
+      heap[i] = h;
+      slot[h] = i;
+    }
+
+    void siftUp(size_t i) {
+      handle_type h = heap[i];
+      while(i > 0) {
+        size_t parent = (i - 1) / D;
+        if(!above(h, heap[parent])) break;
+        place(i, heap[parent]);
+        i = parent;
+      }
+      place(i, h);
+    }
+
+    void siftDown(size_t i) {
+      handle_type h = heap[i];
+      size_t n = heap.size();
+      while(true) {
+        size_t first = i * D + 1, best = i;
+        handle_type best_h = h;
+        for(size_t c = first; c < first + D and c < n; c++) {
+          if(above(heap[c], best_h)) {
+            best = c;
+            best_h = heap[c];
+          }
+        }
+        if(best == i) break;
+        place(i, best_h);
+        i = best;
+      }
+      place(i, h);
+    }
+
+    std::vector<T> values;          // by handle.
+    std::vector<handle_type> heap;  // handles in heap order.
+    std::vector<size_t> slot;       // slot of each handle in heap.
+    std::vector<size_t> dirty;      // scratch of update_many.
+    Compare less;
+  };
+
+  template<class T, class Compare, size_t D>
+  const typename IndexedHeap<T, Compare, D>::handle_type IndexedHeap<T, Compare, D>::npos;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef HETEROSAMPLER_LOCKSTEP
+#define HETEROSAMPLER_LOCKSTEP
+
+#include "utils.h"
+#include "tag.h"
+#include "model.h"
+
+namespace HeteroSampler {
+  /* K Gibbs chains of one instance, stored as structure of arrays and advanced
+   * in lockstep: each step resamples the same position in all chains.
+   * the conditional of a position only depends on the labels of its Markov blanket,
+   * so chains that agree on the blanket share one feature extraction and weight lookup.
+   * the draws of all chains then run as loops over k on contiguous arrays. */
+  struct LockstepChains {
+  public:
+    LockstepChains(ptr<ModelCRFGibbs> model, const Instance& seq, size_t K, objcokus& rng);
+
+    // resample <pos> in all chains.
+    void sampleOne(int pos, objcokus& rng);
+
+    // resample every position once in all chains.
+    void sweep(objcokus& rng);
+
+    // label of <pos> in chain <k>.
+    int getLabel(int pos, size_t k) const {return labels[pos * K + k]; }
+
+    // chain <k> as a tag.
+    ptr<Tag> chain(size_t k) const;
+
+    const size_t K, L, N;     // chains, labels, positions.
+    vec<int> labels;          // [pos][k].
+    vec<double> sc;           // [pos][label][k]: log conditional at the last step of pos.
+    vec<double> log_weight;   // [k]: running log-score, as log_prior_weight of a node.
+    size_t extractions;       // conditionals computed, at most one per distinct blanket and step.
+
+  private:
+    ptr<ModelCRFGibbs> model;
+    Tag scratch;              // blanket labels of the chain whose conditional is computed.
+    vec<double> cond, prob, acc, coin;  // prob: [label][k].
+    vec<int> choice;
+  };
+}
+
+#endif
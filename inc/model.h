@@ -5,6 +5,8 @@
 #include "gm.h"
 #include "corpus.h"
 #include "MarkovTree.h"
+#include "numa.h"
+#include <atomic>
 
 namespace HeteroSampler {
   inline static void adagrad(ParamPointer param, ParamPointer G2, ParamPointer gradient, double eta) {
@@ -32,7 +34,8 @@ namespace HeteroSampler {
     // use Gibbs to sample <choice> with random number generator <rng> and feature extraction functional <feat_extract>
     // flags:
     //  use_meta_feature: only reward, tags, and sc would be updated if set true.
-    virtual void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature = true);
+    //  argmax: take the most likely label instead of sampling (ICM).
+    virtual void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature = true, bool argmax = false);
 
     // sample using custom kernel choice at initialization.
     // only applies if "init" flag is on (not equal to *random*).
@@ -66,12 +69,38 @@ namespace HeteroSampler {
     // return 0: hit count.
     // return 1: pred count.
     std::tuple<int, int> evalPOS(const Tag& tag);
+    // decode <gm> in place from the marginals accumulated while sampling.
+    //  DECODE_MARGINAL: take the label with max marginal at each position.
+    //  DECODE_MBR: take the labeling with max expected token hits (sum of marginals)
+    //              among those whose label transitions all occur in the training corpus.
+    //              for NER this stands in for chunk-level MBR: only per-position marginals
+    //              are kept, and expected chunk hits would need joint samples.
+    // positions never sampled keep their current label.
+    virtual void decodeMarginal(GraphicalModel& gm);
+
     // evaulate the F1 score for NER tag aginst truth.
     // return 0: hit count.
     // return 1: pred count.
     // return 2: truth count.
     std::tuple<int, int, int> evalNER(const Tag& tag);
 
+    /* the truth of an instance in integer form, so a labeling is scored without
+     * strings or a truth sample: truth labels and, for NER, chunk boundaries. */
+    struct EvalTable {
+    public:
+      bool chunks;                        // score chunks (NER) instead of labels.
+      vec<int> truth;
+      vec<char> label_ch;                 // per label: first character of its name.
+      vec<char> label_chunk;              // per label: not "O" or ".", so a type change starts a chunk.
+      vec<char> label_bracket;            // per label: "[" or "]".
+      vec<char> type_begin, type_end;     // per position: token type differs from the previous / next token.
+      vec<char> truth_begin, truth_end;   // per position: chunk boundaries of the truth.
+    };
+    ptr<EvalTable> makeEvalTable(const Instance& seq, bool chunks);
+
+    // (hit, pred, truth) counts of <labels> against <table>, as evalPOS (truth count 0) or evalNER.
+    std::tuple<int, int, int> evalLabels(const EvalTable& table, const vec<int>& labels);
+
     // return the Markov blanket of the node.
     // default: return the Markov blanket of node *id*
     virtual vec<int> markovBlanket(const GraphicalModel& gm, int pos) {
@@ -89,6 +118,15 @@ namespace HeteroSampler {
       return markovBlanket(gm, pos);
     }
 
+    // greedy colouring of the graph given by markovBlanket and invMarkovBlanket.
+    // return the positions of each colour class: no two positions in a class
+    // are in each other's Markov blanket, so a class can be sampled in parallel.
+    vec<vec<int> > colorGraph(const GraphicalModel& gm);
+
+    // hint that <pos> of <gm> is sampled soon: prefetch the data its kernel reads.
+    // default: nothing.
+    virtual void prefetch(const GraphicalModel& gm, int pos) const {}
+
     /* parameters */
     size_t T, B, Q;
     double testFrequency;
@@ -96,8 +134,16 @@ namespace HeteroSampler {
     std::vector<objcokus> rngs;
     ptr<Corpus> corpus;
     ParamPointer param, G2, stepsize;   // model.
+    vec<ParamPointer> param_replica;    // read-only copies of param, one per NUMA node.
+
+    // param as read by the calling thread: the replica of its NUMA node if there is one.
+    const ParamPointer& localParam() const {
+      int node = currentNumaNode();
+      if(node >= 0 and (size_t)node < param_replica.size()) return param_replica[node];
+      return param;
+    }
 
-    int time;
+    std::atomic<int> time;
 
     /* IO */
     friend std::ostream& operator<<(std::ostream& os, const Model& model);
@@ -131,6 +177,16 @@ namespace HeteroSampler {
       }
     }
 
+    enum Decoding {DECODE_MAX, DECODE_MARGINAL, DECODE_MBR};
+    Decoding decoding;
+
+    void parseDecoding(std::string decoding_str) {
+      if(decoding_str == "max") decoding = DECODE_MAX;
+      else if(decoding_str == "marginal") decoding = DECODE_MARGINAL;
+      else if(decoding_str == "mbr") decoding = DECODE_MBR;
+      else throw "decoding method invalid";
+    }
+
     // options
     const boost::program_options::variables_map& vm;
 
@@ -140,6 +196,11 @@ namespace HeteroSampler {
 
     int K;          // num of particle.
     int num_ob;     // current number of observations.
+
+  private:
+    // label transitions observed in the training corpus, used by DECODE_MBR.
+    // row numLabels holds the labels observed at the start of an instance.
+    vec<vec<bool> > transitions;
   };
 
   typedef std::shared_ptr<Model> ModelPtr;
@@ -186,9 +247,15 @@ namespace HeteroSampler {
 
 
     /* implement inferface for Gibbs sampling */
-    virtual void sampleOne(GraphicalModel& tag, objcokus& rng, int choice, bool use_meta_feature = true);
+    virtual void sampleOne(GraphicalModel& tag, objcokus& rng, int choice, bool use_meta_feature = true, bool argmax = false);
+    virtual void prefetch(const GraphicalModel& gm, int pos) const;
     virtual void sampleOneAtInit(GraphicalModel& tag, objcokus& rng, int choice, bool use_meta_feature = true);
 
+    // normalized log conditional of each label of <pos> given the rest of <tag>.
+    // the features of each label are appended to <featvec> if given.
+    void logConditional(Tag& tag, int pos, FeatureExtractOne feat_extract, vec<double>& sc,
+                        vec<FeaturePointer>* featvec = nullptr);
+
     /* implement interface for making samples */
     virtual ptr<GraphicalModel> makeSample(const Instance& instance, ptr<Corpus> corpus, objcokus* rng) const;
     virtual ptr<GraphicalModel> makeTruth(const Instance& instance, ptr<Corpus> corpus, objcokus* rng) const;
@@ -222,10 +289,11 @@ namespace HeteroSampler {
     //  grad_expect: add gradient based on expectation if set true.
     //  grad_sample: add gradient based on current sample if set true.
     //  meta_feature: do not change the meta features of tag if set true.
+    //  argmax: take the most likely label instead of sampling.
     ParamPointer proposeGibbs(Tag& tag, objcokus& rng, int pos, FeatureExtractOne feat_extract,
-      bool grad_expect, bool grad_sample, bool meta_feature);
+      bool grad_expect, bool grad_sample, bool meta_feature, bool argmax = false);
 
-    void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, FeatureExtractOne feat_extract, bool use_meta_feature = true);
+    void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, FeatureExtractOne feat_extract, bool use_meta_feature = true, bool argmax = false);
 
     FeaturePointer extractFeaturesAll(const Tag& tag);
 
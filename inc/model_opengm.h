@@ -20,7 +20,7 @@ namespace HeteroSampler {
       throw "OpenGM does not support gradient.";
     }
 
-    virtual void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature = true);
+    virtual void sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature = true, bool argmax = false);
 
     virtual double score(const GraphicalModel& gm);
 
@@ -65,6 +65,7 @@ namespace HeteroSampler {
       temp_magnify = vm["temp_magnify"].as<double>();
     }
     temp_init = vm["temp_init"].as<double>();
+    temp = temp_init;
   }
 
   template<class GM, class ACC> 
@@ -99,14 +100,14 @@ namespace HeteroSampler {
 
 
   template<class GM, class ACC>
-  void ModelEnumerativeGibbs<GM, ACC>::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature) {
+  void ModelEnumerativeGibbs<GM, ACC>::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature, bool argmax) {
     if(choice >= (int)gm.size()) 
       throw "Gibbs sampling proposal out of bound.";
     auto& opengm_ = dynamic_cast<OpenGM<GraphicalModelType>& >(gm);
     vec<double> sc(gm.numLabels(choice));
     auto computeSc = [&] (int choice) {
       for(size_t t = 0; t < gm.numLabels(choice); t++) {
-        ValueType value = opengm_.valueAfterMove(&choice, &choice + 1, &t);
+        ValueType value = opengm_.localValue(choice, t);
         double score = (double)value;
         if(typeid(AccumulationType) == typeid(opengm::Maximizer)) { // Maximum probability.
           score = log(score);
@@ -118,9 +119,9 @@ namespace HeteroSampler {
       logNormalize(&sc[0], gm.numLabels(choice));
     };
     /* estimate temperature */
-    if(gm.time == 0) {    // compute initial temperature.
-      temp = temp_init;
-      if(annealing == "scanline") {
+    if(annealing == "scanline") {
+      if(gm.time == 0) {    // compute initial temperature.
+        temp = temp_init;
         double q = 0;
         vec<LabelType> labels = opengm_.getLabels();
         for(int i = 0; i < (int)gm.size(); i++) {
@@ -129,22 +130,23 @@ namespace HeteroSampler {
         }
         q /= (double)gm.size();
         temp = temp_magnify * q;
-      }
-    }else if(gm.time % gm.size() == 0 and use_meta_feature) {
-      if(annealing == "scanline") {
+      }else if(gm.time % gm.size() == 0 and use_meta_feature) {
         temp = temp * temp_decay;
       }
     }
 
     /* sampling */
     computeSc(choice);
-    size_t val = rng.sampleCategorical(&sc[0], gm.numLabels(choice));
+    size_t val;
+    if(argmax)
+      val = std::max_element(sc.begin(), sc.end()) - sc.begin();
+    else
+      val = rng.sampleCategorical(&sc[0], gm.numLabels(choice));
     size_t oldval = opengm_.state(choice);
     if(use_meta_feature) {
       gm.oldlabels[choice] = oldval;
     }
     gm.reward[choice] = (sc[val] - sc[oldval]) * temp;  // use reward without temperature.
-    gm.sc = sc;
     
     if(use_meta_feature) {
       gm.prev_sc[choice] = gm.this_sc[choice];
@@ -152,11 +154,12 @@ namespace HeteroSampler {
       gm.prev_entropy[choice] = gm.entropy[choice];
       gm.entropy[choice] = logEntropy(&sc[0], gm.numLabels(choice));
       gm.timestamp[choice]++;
-      gm.time++;
+    }else{
+      gm.sc = sc;
     }
 
     /* compute stats */
-    opengm_.move(&choice, &choice + 1, &val);
+    opengm_.setLabel(choice, val);
   }
 
 }
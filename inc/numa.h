@@ -0,0 +1,88 @@
+#ifndef HETEROSAMPLER_NUMA
+#define HETEROSAMPLER_NUMA
+
+#include "utils.h"
+#include <pthread.h>
+#include <sched.h>
+
+namespace HeteroSampler {
+  /* NUMA topology from sysfs, without a dependency on libnuma.
+   * on machines without /sys/devices/system/node, all cpus form node 0. */
+  struct NumaTopology {
+  public:
+    NumaTopology() {
+      for(int n = 0; ; n++) {
+        std::ifstream file("/sys/devices/system/node/node" + to_string(n) + "/cpulist");
+        if(!file.is_open()) break;
+        string line;
+        getline(file, line);
+        cpus.push_back(parseCpuList(line));
+        if(cpus.back().size() == 0) cpus.pop_back();  // memory-only node.
+      }
+      if(cpus.size() == 0) {
+        cpus.resize(1);
+        for(size_t c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++) {
+          cpus[0].push_back(c);
+        }
+      }
+    }
+
+    size_t numNodes() const {return cpus.size(); }
+
+    // node of thread <tid> among <num_threads>: threads are split into contiguous
+    // blocks, so neighbouring thread ids (tried first by ThreadPool stealing) share a node.
+    int nodeOf(size_t tid, size_t num_threads) const {
+      return (int)(tid * numNodes() / std::max((size_t)1, num_threads));
+    }
+
+    // parse a sysfs cpu list such as "0-3,8-11".
+    static vec<int> parseCpuList(const string& line) {
+      vec<int> ret;
+      vec<string> ranges;
+      boost::split(ranges, line, boost::is_any_of(","));
+      for(const string& range : ranges) {
+        if(range == "") continue;
+        size_t dash = range.find('-');
+        int lo = std::stoi(range.substr(0, dash));
+        int hi = dash == string::npos ? lo : std::stoi(range.substr(dash + 1));
+        for(int c = lo; c <= hi; c++) ret.push_back(c);
+      }
+      return ret;
+    }
+
+    vec<vec<int> > cpus;   // cpus of each node.
+  };
+
+  // restrict <thread> to <cpus>, return false if the system refused.
+  inline static bool pinThread(pthread_t thread, const vec<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int c : cpus) {
+      if(c >= 0 and c < CPU_SETSIZE) CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+  }
+
+  // NUMA node the calling thread runs its work on, -1 if not placed.
+  inline static int& currentNumaNode() {
+    static thread_local int node = -1;
+    return node;
+  }
+
+  // copy <param> with its pages first touched on node <node>, so reads from that node stay local.
+  inline static ParamPointer replicateOnNode(ParamPointer param, const NumaTopology& topo, int node) {
+    cpu_set_t saved;
+    pthread_t self = pthread_self();
+    bool restore = pthread_getaffinity_np(self, sizeof(saved), &saved) == 0;
+    pinThread(self, topo.cpus[node]);
+    ParamPointer replica = makeParamPointer();
+    replica->reserve(param->size());
+    for(const ParamItem& p : *param) {
+      replica->insert(p);
+    }
+    if(restore) pthread_setaffinity_np(self, sizeof(saved), &saved);
+    return replica;
+  }
+}
+
+#endif
@@ -23,9 +23,17 @@ public:
     return (int)opengm::Movemaker<GM>::state(id);
   }
 
+  /* only touches the state of <id>, so labels of non-adjacent variables
+   * can be set concurrently. the energy cache of the Movemaker is not
+   * maintained, use Model::score to evaluate a labeling. */
   virtual void setLabel(int id, int val) {
-    this->move(&id, &id + 1, &val);
+    this->state_[id] = val;
+    this->stateBuffer_[id] = val;
   }
+
+  /* value of the factors of <id> if it took <label>, other labels fixed.
+   * only reads the state, so it is safe to call concurrently. */
+  ValueType localValue(int id, LabelType label) const;
   
   vec<LabelType> getLabels() const;
 
@@ -50,6 +58,23 @@ OpenGM<GM>::OpenGM(const Instance* seq, const GraphicalModelType& gm)
   this->initStats();
 }
 
+template<class GM>
+typename OpenGM<GM>::ValueType OpenGM<GM>::localValue(int id, LabelType label) const {
+  ValueType value;
+  OperatorType::neutral(value);
+  vec<LabelType> factor_state;
+  for(size_t f : this->factorsOfVariable_[id]) {
+    const FactorType& factor = gm_[f];
+    factor_state.resize(factor.numberOfVariables());
+    for(size_t j = 0; j < factor.numberOfVariables(); j++) {
+      size_t var = factor.variableIndex(j);
+      factor_state[j] = var == (size_t)id ? label : this->state_[var];
+    }
+    OperatorType::op(factor(factor_state.begin()), value);
+  }
+  return value;
+}
+
 template<class GM>
 vec<typename OpenGM<GM>::LabelType> OpenGM<GM>::getLabels() const { // why cannot use vec<LabelType>.
   vec<LabelType> ret(gm_.numberOfVariables());
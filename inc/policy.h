@@ -4,6 +4,9 @@
 #include "utils.h"
 #include "model.h"
 #include "MarkovTree.h"
+#include "lockstep.h"
+#include "cost.h"
+#include "recorder.h"
 #include "tag.h"
 #include "ThreadPool.h"
 #include <boost/program_options.hpp>
@@ -30,6 +33,7 @@ enum MetaFeature { FEAT_BIAS,
                    FEAT_EXP_SP,
                    FEAT_SP_COND_ENT,
                    FEAT_SP_UNIGRAM_ENT,
+                   FEAT_COUNT,  // number of meta-features.
                  };
 
 struct MetaFeatureHash
@@ -75,8 +79,19 @@ public:
 
     double score;
     double time;
-    double wallclock;
-    double wallclock_policy, wallclock_sample;
+    double wallclock;              // real time, from a monotonic clock.
+    double cputime;                // process CPU time, summed over threads.
+    double wallclock_policy, wallclock_sample;  // real time of policy / sampling steps, summed over threads.
+    double hit_count, pred_count, truth_count;  // counts behind score in the last test.
+    std::vector<int> stop_sweep;   // sweep at which each chain converged, -1 if it ran to T.
+
+    /* per sentence, for Policy::evaluate: the truth tables, the node last scored with its
+     * restarts and depth then, and its (hit, pred, truth) counts. */
+    std::vector<ptr<Model::EvalTable> > eval_table;
+    std::vector<std::weak_ptr<MarkovTreeNode> > eval_node;
+    std::vector<size_t> eval_restarts;
+    std::vector<int> eval_depth;
+    std::vector<std::tuple<double, double, double> > eval_count;
 
     size_t size() const {
       return nodes.size();
@@ -119,16 +134,44 @@ public:
   /* sub-procedure to train policy */
   virtual void train_policy(ptr<Corpus> corpus);
 
+  /* apply the gradients accumulated by each training thread to param (--sync_every) */
+  void mergeGradients();
+
 
   /// methods for sampling.
   /* sample node, default uses Gibbs sampling */
   virtual void sample(int tid, MarkovTreeNodePtr node);
 
+  /* sample a group of independent chains as Policy::sample does, one step of each
+   * in turn, prefetching the next chain's data while the current one samples */
+  void sampleInterleaved(int tid, const vec<MarkovTreeNodePtr>& nodes);
+
+  /* initialize node according to init_method */
+  void sampleInit(MarkovTreeNodePtr node, objcokus& rng);
+
   /* wrap model->sampleOne */
   MarkovTreeNodePtr sampleOne(MarkovTreeNodePtr, objcokus& rng, int pos);
 
+  /* bookkeeping after <pos> of node has been resampled from <oldval> */
+  MarkovTreeNodePtr commitSample(MarkovTreeNodePtr node, int pos, int oldval);
+
+  /* whether the kernel at <pos> should take the argmax (see icm) */
+  bool greedy(MarkovTreeNodePtr node, int pos) const {
+    return icm >= 0 and node->gm->mask[pos] >= icm;
+  }
+
+  /* final prediction of node: the best sample seen, or the marginal decoding.
+   * under lean sampling, the best sample is built here. */
+  ptr<GraphicalModel> decode(MarkovTreeNodePtr node);
+
+  /* (hit, pred, truth) counts of the decoded chain <node> of sentence <i> of result.
+   * a sentence whose decoded sample is the one scored last time is not scored again. */
+  std::tuple<double, double, double> evaluate(ResultPtr result, size_t i, MarkovTreeNodePtr node);
+
   /* update resp of the meta-features */
   void updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* heap);
+  // heap priority of position <id>, default: its response.
+  virtual double priority(MarkovTreeNodePtr node, int id) {return node->gm->resp[id]; }
 
   /* return a number referring to the transition kernel to use.
    * return value:
@@ -147,8 +190,34 @@ public:
   /* sample delayed reward without making changes to <node> */
   double sampleDelayedReward(MarkovTreeNodePtr node, int id, int maxdepth, int rewardK);
 
-  /* extract meta-features from node */
-  virtual FeaturePointer extractFeatures(MarkovTreeNodePtr node, int pos);
+  /* extract meta-features of <pos> into its dense row (GraphicalModel::meta)
+   * and its features keyed by value (GraphicalModel::feat) */
+  virtual void extractFeatures(MarkovTreeNodePtr node, int pos);
+
+  /* response of <pos>: its dense row dot weight, plus the features keyed by value */
+  double response(const GraphicalModel& gm, int pos) const;
+
+  /* meta-features of <pos> keyed by name, as in param */
+  FeaturePointer featureList(const GraphicalModel& gm, int pos) const;
+
+  /* copy the weights of the dense meta-features from param, after param changed.
+   * if <changed> is given, only its keys are copied, e.g. the keys of a gradient. */
+  void syncWeights(ParamPointer changed = nullptr);
+
+  /// learned stop rule, weights are the "stop-" keys of param.
+  /* instance-level meta-features of node at the end of a sweep */
+  FeaturePointer extractStopFeatures(MarkovTreeNodePtr node);
+
+  /* called at the end of each sweep: true if the stop rule says to stop.
+   * training chains (with a stop_trace) record the sweep instead and never stop. */
+  bool learnedStop(MarkovTreeNodePtr node);
+
+  /* logistic regression step on the sweeps of a training chain: stopping at a sweep
+   * is right if no later sweep scores better against the truth. */
+  void trainStop(const StopTrace& trace);
+
+  /* score of the labels of gm against the truth, higher is better */
+  double evalSample(const GraphicalModel& gm);
 
 
   /// dump a node to file.
@@ -158,42 +227,11 @@ public:
   /* reset log stream */
   void resetLog(std::shared_ptr<XMLlog> new_lg);
 
-  // response-reward pair.
-  struct PolicyExample {  // examples used to train policy.
-    double reward;
-    double resp;
-    double staleness;
-    FeaturePointer feat;    // copy and record.
-    ParamPointer param;     // copy and record.
-    string str, oldstr;     // copy and record.
-    MarkovTreeNodePtr node; // just record.
-    int choice;
-    void serialize(ptr<XMLlog> lg) {
-      lg->begin("example");
-      lg->logAttr("item", "reward", reward);
-      lg->logAttr("item", "staleness", staleness);
-      lg->logAttr("item", "resp", resp);
-      for (auto& p : *feat) {
-        lg->logAttr("feat", p.first, p.second);
-      }
-      for (auto& p : *param) {
-        lg->logAttr("param", p.first, p.second);
-      }
-      lg->logAttr("item", "choice", choice);
-      if (node != nullptr) {
-        lg->begin("instance");
-        *lg << str << std::endl;
-        lg->end();
-        lg->begin("old_instance");
-        *lg << oldstr << std::endl;
-        lg->end();
-      }
-      lg->end(); // <example>
-    }
-  };
-
-  bool lets_resp_reward;
-  vec<PolicyExample> examples;
+  // record a bounded sample of training examples (response, reward, meta-features) to --record.
+  const bool lets_resp_reward;
+  const string record_path;
+  const size_t record_size;     // examples kept in memory.
+  ptr<ExampleRecorder> recorder;
 
   /* const environment. */
   const string name;
@@ -210,11 +248,34 @@ public:
   bool verboseOptFind(string verse) {return std::find(verbose_opt.begin(), verbose_opt.end(), verse) != verbose_opt.end(); }
 
   const bool lets_inplace;              // not work with entire history.
+  const double icm;                     // visits after which a position's kernel turns greedy (ICM), -1 = never.
+  const bool converge;                  // stop each chain once it is judged converged.
+  const double converge_change, converge_ent, converge_rhat;  // thresholds per sweep.
+  const string schedule;                // order chains are handed to threads at test: fifo / longest.
+  const size_t interleave;              // chains advanced in turn by each test thread.
+  const bool lockstep;                  // run the auxiliary R-hat chains in lockstep.
+  const bool numa;                      // pin test threads to NUMA nodes, replicate model weights per node.
+  const bool learn_stop;                // stop each chain by a learned rule over instance-level meta-features.
+  std::unordered_map<const Instance*, ptr<Model::EvalTable> > stop_tables;  // evalSample: truth tables of training instances.
+  std::mutex stop_tables_mutex;
+  const size_t sync_every;              // train: sentences sampled in parallel between merges of the gradients (0 = adagrad at every step).
+  vec<ParamPointer> thread_grad;        // gradients of each training thread since the last merge.
+  bool lean;                            // nothing reads meta-features: skip updateResp, build max_gm on demand.
   // feature option, each string switches a meta-feature to add.
 
   vec<MetaFeature> feat;
   map<string, MetaFeature> feat_map;
   std::unordered_map<MetaFeature, string, MetaFeatureHash> feat_name;
+  vec<int> feat_slot;      // column of each meta-feature in the dense rows, -1 if keyed by value or unused.
+  vec<double> weight;      // param of each column.
+  vec<double> discord_weight;  // param of nb-discord "c-<label>-<neighbour label>", discord_labels per row.
+  size_t discord_labels;
+
+  // weight of a neighbour leaving label <val> next to label <yourval>.
+  double discordWeight(int yourval, int val) const {
+    return (size_t)yourval < discord_labels and (size_t)val < discord_labels ?
+      discord_weight[yourval * discord_labels + val] : 0;
+  }
 
   /* global environment. */
   ModelPtr model;                 // full model.
@@ -225,7 +286,45 @@ public:
   ParamPointer param, G2;
 
   /* parallel environment. */
-  ThreadPool<MarkovTreeNodePtr> thread_pool, test_thread_pool;
+  ThreadPool<MarkovTreeNodePtr> thread_pool;
+  ThreadPool<vec<MarkovTreeNodePtr> > test_thread_pool;  // works are groups of interleaved chains.
+
+  /* chains of a test run, marked by the workers as they finish. */
+  struct TestStream {
+  public:
+    TestStream(const vec<MarkovTreeNodePtr>& nodes)
+    :done(nodes.size(), false) {
+      for (size_t i = 0; i < nodes.size(); i++) index[nodes[i].get()] = i;
+    }
+
+    void finish(const MarkovTreeNode* node) {
+      std::lock_guard<std::mutex> lock(mutex);
+      done[index.at(node)] = true;
+      cv.notify_one();
+    }
+
+    /* block until the i-th chain has finished */
+    void wait(size_t i) {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!done[i]) cv.wait(lock);
+    }
+
+    std::unordered_map<const MarkovTreeNode*, size_t> index;
+    vec<bool> done;
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  ptr<TestStream> test_stream;
+
+  /* NUMA placement of test threads, used if numa */
+  NumaTopology numa_topo;
+  vec<int> numa_node;                   // node of each test thread.
+  vec<size_t> numa_samples;             // positions sampled by each test thread in this test.
+  vec<double> numa_busy;                // seconds each test thread spent sampling in this test.
+  // run the chains of <nodes> on the node of thread <tid>.
+  void placeOnNode(int tid, const vec<MarkovTreeNodePtr>& nodes);
+  // log throughput per node.
+  void logNuma();
 };
 
 
@@ -239,7 +338,44 @@ public:
   //       second/third pass only update words with entropy exceeding threshold.
   virtual Location policy(MarkovTreeNodePtr node);
 
+  // called at the end of each sweep: true if the fraction of labels changed,
+  // the mean entropy change and the R-hat over K chains are all below thresholds.
+  bool converged(MarkovTreeNodePtr node);
+
+  // called at the end of each sweep if converge or learn_stop: true (and stop_sweep is set)
+  // if the chain should stop.
+  bool endSweep(MarkovTreeNodePtr node);
+
+  /* with chromatic sweeps, run sweeps of colour classes in parallel */
+  virtual void sample(int tid, MarkovTreeNodePtr node);
+
+  /* random streams of the sweep_pool jobs of node, seeded from <rng> on first use */
+  vec<objcokus>& jobRngs(MarkovTreeNodePtr node, objcokus& rng);
+
+  /* one sweep: each colour class is sampled in parallel on sweep_pool */
+  void sampleChromatic(MarkovTreeNodePtr node, objcokus& rng);
+
+  /* <sweeps> asynchronous sweeps: each thread samples a shard of positions
+   * in random order, reading neighbor labels without synchronization. */
+  void sampleHogwild(MarkovTreeNodePtr node, objcokus& rng, size_t sweeps);
+
+  /* split the image of node into tiles of tile x tile pixels, each with its own chain
+   * and its own random stream seeded from <rng> */
+  void makeTiles(MarkovTreeNodePtr node, objcokus& rng);
+
+  /* refresh the halo of <tile> from the full image <gm> */
+  void pullHalo(Tile& tile, const GraphicalModel& gm);
+
+  /* write the interiors of the tiles back into node, which took <samples> steps */
+  void mergeTiles(MarkovTreeNodePtr node, size_t samples);
+
+  /* one sweep: each tile sweeps its interior in parallel on sweep_pool */
+  void sampleTiled(MarkovTreeNodePtr node, objcokus& rng);
+
   size_t T; // how many sweeps.
+  const string sweep;  // sequential / chromatic / hogwild / tiled.
+  const int tile;      // side length of tiles for tiled sweeps.
+  ptr<JobPool> sweep_pool;
 };
 
 class BlockPolicy : public GibbsPolicy {
@@ -257,6 +393,13 @@ public:
   public:
     Result(ptr<Corpus> corpus);
     Heap heap;
+
+    /* multiqueue: sentences are dealt to shards, each with its own heap and lock. */
+    struct Shard {
+      Heap heap;
+      std::mutex mutex;
+    };
+    vec<ptr<Shard> > shards;
   };
 
   typedef ptr<BlockPolicy::Result> ResultPtr;
@@ -286,6 +429,64 @@ public:
   virtual void test_policy(ResultPtr result, double budget);
 
   virtual Location policy(ResultPtr result);
+
+  /* spend <budget> per position with one heap per tile, tiles run in parallel */
+  void sampleTiled(ResultPtr result, double budget);
+  using GibbsPolicy::sampleTiled;
+
+  /* take <steps> samples with numThreads threads, each picking the better top of two
+   * random shards (a relaxed priority queue), instead of the top of one global heap */
+  void sampleMultiQueue(ResultPtr result, size_t steps);
+
+  const size_t multiqueue;  // shards per thread, 0 = one global heap, serial.
+
+  /* cost-aware scheduling: rank positions by expected gain per estimated CPU-second,
+   * and charge the budget in estimated seconds */
+  const bool cost_aware;
+  CostModel costs;           // kernel cost by degree of the position.
+  // estimated seconds to sample and update position <id>.
+  double cost(MarkovTreeNodePtr node, int id);
+  virtual double priority(MarkovTreeNodePtr node, int id);
+
+  /* freezing: a position is erased from the heap after <freeze> consecutive visits
+   * in which its entropy changed by at most converge_ent and its blanket kept its labels,
+   * and restored once a neighbour changes label. 0 = never freeze. */
+  const size_t freeze;
+  // update the stability of <pos> after a visit, freeze it or thaw its neighbours.
+  void freezeOrThaw(ResultPtr result, MarkovTreeNodePtr node, int pos, int oldval, bool blanket_stable);
+
+  /* deadline mode: a budget b buys b * deadline seconds of wall clock, per corpus or
+   * per sentence (deadline_scope). 0 = budgets count samples. */
+  const double deadline;
+  const string deadline_scope;
+  // sample the top of the heap until <deadline>, return the number of samples.
+  // if <sentence_seconds> > 0, a sentence leaves the heap once its steps took that long,
+  // and is put back before returning.
+  size_t sampleUntil(ResultPtr result, std::chrono::steady_clock::time_point deadline, double sentence_seconds = 0);
+};
+
+/* Training-free scheduler
+ * > uses the heap and budget of BlockPolicy, but ranks positions by a residual
+ *   computed from the statistics the sampler keeps anyway, so train is a no-op.
+ * > residual: kl       - KL divergence of the conditional from its previous visit.
+ *             ent-vary - entropy times neighbour samples since the last visit.
+ *             stale    - neighbours whose label changed since the last visit.
+ */
+class ResidualPolicy : public BlockPolicy {
+public:
+  ResidualPolicy(ModelPtr model, const variables_map& vm);
+
+  virtual void train(ptr<Corpus> corpus);
+
+  /* sample, then re-rank the position and, unless residual is kl, its neighbours */
+  virtual MarkovTreeNodePtr sampleOne(ResultPtr result,
+                                      objcokus& rng,
+                                      const Location& loc);
+  using BlockPolicy::sampleOne;
+
+  virtual double priority(MarkovTreeNodePtr node, int id);
+
+  const string residual;
 };
 
 }
@@ -0,0 +1,73 @@
+#ifndef HETEROSAMPLER_RECORDER
+#define HETEROSAMPLER_RECORDER
+
+#include "utils.h"
+#include "corpus.h"
+#include "objcokus.h"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+
+namespace HeteroSampler {
+  /* bounded recorder of policy training examples, one offered per training step.
+   * a reservoir keeps a uniform sample of <capacity> examples, stored column by column.
+   * param is not copied per example: every step appends the values of the keys it changed
+   * to <path>.param under a new version, so the param an example was trained with is the
+   * version 0 snapshot plus all deltas up to its version. feature and param names are
+   * interned and written once. all methods may be called from several threads.
+   *
+   * <path>, little endian:
+   *   "HSREC1", uint64 n, then columns of n examples:
+   *   double reward, resp, staleness; uint64 version, instance; int32 choice, oldval, newval;
+   *   uint64 feat_begin[n + 1], then int32 feat_key[], double feat_value[];
+   *   uint64 number of names, then each name as uint32 length and bytes.
+   * <path>.param: records of uint64 version, int32 key, double value. */
+  class ExampleRecorder {
+  public:
+    ExampleRecorder(const string& path, size_t capacity, uint32 seed = 0);
+    ~ExampleRecorder();
+
+    // log all of <param> as version 0.
+    void start(ParamPointer param);
+
+    // a step changed the keys of <delta>: log their values in <param> as the next version.
+    void commit(ParamPointer delta, ParamPointer param);
+
+    // offer an example, trained with the current version, to the reservoir.
+    // <instance> is numbered in the order instances are first seen.
+    void record(double reward, double resp, double staleness, const Instance* instance,
+                int choice, int oldval, int newval, FeaturePointer feat);
+
+    // write the reservoir to <path> and close both files.
+    void close();
+
+    size_t seen() const {return num_seen; }
+    size_t size() const {return reward.size(); }
+    uint64_t version() const {return num_versions; }
+
+    const string path;
+    const size_t capacity;
+
+  private:
+    int intern(const string& name);
+    void writeDelta(const string& key, double value);
+
+    std::mutex rec_mutex;
+    objcokus rng;
+    std::ofstream param_file;
+    bool closed;
+    size_t num_seen;
+    uint64_t num_versions;
+    std::unordered_map<string, int> name_id;
+    vec<string> names;
+    std::unordered_map<const Instance*, uint64_t> instance_id;
+
+    /* reservoir, one entry per example. */
+    vec<double> reward, resp, staleness;
+    vec<uint64_t> versions, instances;
+    vec<int32_t> choice, oldval, newval;
+    vec<vec<std::pair<int32_t, double> > > feat;
+  };
+}
+
+#endif
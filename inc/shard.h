@@ -0,0 +1,67 @@
+#ifndef HETEROSAMPLER_SHARD
+#define HETEROSAMPLER_SHARD
+
+#include "utils.h"
+#include "model.h"
+#include <sys/types.h>
+
+namespace HeteroSampler {
+  /* tab-separated lines over a local stream socket. */
+  struct ShardChannel {
+  public:
+    ShardChannel(int fd);
+    ~ShardChannel();
+
+    void send(const vec<string>& fields);
+    // block for the next line, return false once the other end has closed.
+    bool recv(vec<string>& fields);
+
+    int fd;
+  private:
+    string buffer;
+  };
+
+  /* summary of a test on one shard, enough to merge the scores of all shards. */
+  struct ShardStats {
+  public:
+    ShardStats() : hit_count(0), pred_count(0), truth_count(0), time(0), wallclock(0), count(0) {}
+
+    vec<string> fields() const;
+    static ShardStats parse(const vec<string>& fields);
+
+    double hit_count, pred_count, truth_count;
+    double time;          // samples per sentence.
+    double wallclock;
+    size_t count;         // sentences in the shard.
+  };
+
+  /* worker processes, each connected to this process (the coordinator) by a socketpair.
+   * create the pool before any thread is started: workers are forked, so they share the
+   * loaded model and corpus copy-on-write and may start threads of their own. */
+  class ShardPool {
+  public:
+    // fork <num_shards> workers, worker <s> runs worker(s, channel) then exits.
+    ShardPool(size_t num_shards, std::function<void(size_t, ShardChannel&)> worker);
+    // close the channels and wait for the workers.
+    ~ShardPool();
+
+    size_t size() const {return channels.size(); }
+
+    // send <fields> to all workers.
+    void broadcast(const vec<string>& fields);
+    // receive one line from each worker, in shard order.
+    vec<vec<string> > gather();
+
+  private:
+    vec<ptr<ShardChannel> > channels;
+    vec<pid_t> pids;
+  };
+
+  // keep every <num_shards>-th of the first <test_count> instances of <corpus>, starting at <shard>.
+  void shardCorpus(ptr<Corpus> corpus, size_t shard, size_t num_shards, size_t test_count);
+
+  // log the merged summary of <stats> to <lg>, with the tags of Policy::test_policy.
+  void logShardSummary(XMLlog& lg, const vec<ShardStats>& stats, Model::Scoring scoring);
+}
+
+#endif
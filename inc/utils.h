@@ -21,7 +21,6 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <boost/program_options.hpp>
-#include <boost/heap/fibonacci_heap.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include "dirent.h"
@@ -31,6 +30,12 @@
 #include "stdlib.h"
 #include "objcokus.h"
 
+#ifdef __GNUC__
+#define HETEROSAMPLER_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HETEROSAMPLER_PREFETCH(addr)
+#endif
+
 namespace HeteroSampler {
   template<class T>
   using ptr = std::shared_ptr<T>;
@@ -123,6 +128,13 @@ namespace HeteroSampler {
     return 0;
   }
 
+  // read-only lookup, safe when several threads share <param>.
+  inline static double getParam(ParamPointer param, const std::string& key) {
+    auto it = param->find(key);
+    if(it == param->end()) return 0;
+    return it->second;
+  }
+
   inline static void insertFeature(FeaturePointer featA, FeaturePointer featB) {
     featA->insert(featA->end(), featB->begin(), featB->end());
   }
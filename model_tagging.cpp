@@ -28,6 +28,7 @@ int main(int argc, char* argv[]) {
       ("depthL", po::value<int>()->default_value(0), "depth size for node-wise features")
       ("factorL", po::value<int>()->default_value(2), "up to what order of gram should be used")
       ("scoring", po::value<string>()->default_value("Acc"), "scoring (Acc, NER)")
+      ("decode", po::value<string>()->default_value("max"), "final prediction: max, marginal, mbr (max expected token hits, not chunk-level)")
       ("train", po::value<string>(), "training data")
       ("test", po::value<string>(), "test data")
       ("testFrequency", po::value<double>()->default_value(0.3), "frequency of testing")
@@ -0,0 +1,70 @@
+/* Sanity check of the integer evaluation tables
+ *  for every sentence of a tagging corpus, score the truth, random labelings and the truth
+ *  with a few labels changed, both with the string-based evalNER / evalPOS and with
+ *  evalLabels on the table from makeEvalTable. the counts must be identical.
+ *  usage: check-eval [corpus], default data/eng_ner/test_small.
+ *  prints "ok" on success.
+ */
+
+#include "corpus.h"
+#include "objcokus.h"
+#include "tag.h"
+#include "model.h"
+#include "utils.h"
+#include <iostream>
+
+using namespace std;
+using namespace HeteroSampler;
+namespace po = boost::program_options;
+
+static string str(const std::tuple<int, int, int>& counts) {
+  return to_string(std::get<0>(counts)) + " " + to_string(std::get<1>(counts)) + " " + to_string(std::get<2>(counts));
+}
+
+int main(int argc, char* argv[]) {
+  try{
+    string path = argc > 1 ? argv[1] : "data/eng_ner/test_small";
+    ptr<Corpus> corpus = ptr<CorpusLiteral>(new CorpusLiteral());
+    corpus->read(path, false);
+    po::variables_map vm;
+    vm.insert(std::make_pair("log", po::variable_value(string("/dev/null"), false)));
+    ptr<Model> model = ptr<ModelCRFGibbs>(new ModelCRFGibbs(corpus, vm));
+    objcokus rng;
+    rng.seedMT(7);
+    size_t taglen = corpus->tags.size(), num_checked = 0;
+    for(const SentencePtr seq : corpus->seqs) {
+      auto ner_table = model->makeEvalTable(*seq, true);
+      auto pos_table = model->makeEvalTable(*seq, false);
+      for(int trial = 0; trial < 20; trial++) {
+        Tag tag(*seq, corpus, &rng, model->param);
+        if(trial >= 10) { // a random labeling.
+          for(size_t i = 0; i < tag.size(); i++) tag.tag[i] = rng.randomMT() % taglen;
+        }else if(trial > 0) { // the truth with a few labels changed.
+          for(int k = 0; k < trial; k++) tag.tag[rng.randomMT() % tag.size()] = rng.randomMT() % taglen;
+        }
+        std::tuple<int, int, int> expect = model->evalNER(tag), got = model->evalLabels(*ner_table, tag.tag);
+        if(expect != got) {
+          cout << "failed: evalNER " << str(expect) << " vs evalLabels " << str(got)
+               << " on " << tag.str() << endl;
+          return 1;
+        }
+        std::tuple<int, int> expect_pos = model->evalPOS(tag);
+        got = model->evalLabels(*pos_table, tag.tag);
+        if(std::get<0>(expect_pos) != std::get<0>(got) or std::get<1>(expect_pos) != std::get<1>(got) or std::get<2>(got) != 0) {
+          cout << "failed: evalPOS vs evalLabels " << str(got) << " on " << tag.str() << endl;
+          return 1;
+        }
+        num_checked++;
+      }
+    }
+    if(num_checked == 0) {
+      cout << "failed: no sentences in " << path << endl;
+      return 1;
+    }
+    cout << "ok" << endl;
+  }catch(char const* ee) {
+    cout << "error: " << ee << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+/* Sanity check of IndexedHeap
+ *  random push / update / erase / restore / update_many sequences, checked after every
+ *  operation against a brute-force max over the active handles (ties go to the earlier handle).
+ *  at the end the heap is drained with erase(top) and must come out in order.
+ *  prints "ok" on success.
+ */
+
+#include "heap.h"
+#include "objcokus.h"
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace HeteroSampler;
+
+struct Item {
+  int value;
+  size_t handle;
+};
+
+struct ItemLess {
+  bool operator()(const Item& a, const Item& b) const {return a.value < b.value; }
+};
+
+typedef IndexedHeap<Item, ItemLess> Heap;
+
+// the handle top() should return: max value among active handles, earliest handle on ties.
+static size_t bruteTop(const vector<int>& values, const vector<bool>& active) {
+  size_t best = Heap::npos;
+  for(size_t h = 0; h < values.size(); h++) {
+    if(!active[h]) continue;
+    if(best == Heap::npos or values[h] > values[best]) best = h;
+  }
+  return best;
+}
+
+static void check(bool cond, const string& what, size_t step) {
+  if(cond) return;
+  cout << "failed: " << what << " at step " << step << endl;
+  exit(1);
+}
+
+int main() {
+  objcokus rng;
+  rng.seedMT(7);
+  for(int round = 0; round < 20; round++) {
+    Heap heap;
+    vector<int> values;
+    vector<bool> active;
+    size_t num_active = 0;
+    auto random_value = [&] () {return (int)(rng.randomMT() % 16); }; // small range, many ties.
+    for(size_t step = 0; step < 2000; step++) {
+      size_t op = rng.randomMT() % 5;
+      if(values.size() == 0 or op == 0) {
+        Item item = {random_value(), values.size()};
+        size_t h = heap.push(item);
+        check(h == values.size(), "push handle", step);
+        values.push_back(item.value);
+        active.push_back(true);
+        num_active++;
+      } else if(op == 1) { // change one value.
+        size_t h = rng.randomMT() % values.size();
+        values[h] = random_value();
+        heap[h].value = values[h];
+        heap.update(h);
+      } else if(op == 2) {
+        size_t h = rng.randomMT() % values.size();
+        if(active[h]) num_active--;
+        active[h] = false;
+        heap.erase(h);
+      } else if(op == 3) {
+        size_t h = rng.randomMT() % values.size();
+        if(!active[h]) num_active++;
+        active[h] = true;
+        heap.restore(h);
+      } else { // change a batch, with repeats and erased handles.
+        vector<size_t> batch;
+        size_t n = 1 + rng.randomMT() % 8;
+        for(size_t k = 0; k < n; k++) {
+          size_t h = rng.randomMT() % values.size();
+          values[h] = random_value();
+          heap[h].value = values[h];
+          batch.push_back(h);
+          if(k > 0 and rng.randomMT() % 4 == 0) batch.push_back(batch[k - 1]);
+        }
+        heap.update_many(batch.begin(), batch.end());
+      }
+      check(heap.size() == num_active, "size", step);
+      check(heap.erased() == values.size() - num_active, "erased", step);
+      for(size_t h = 0; h < values.size(); h++) {
+        check(heap.active(h) == active[h], "active", step);
+      }
+      size_t expect = bruteTop(values, active);
+      check(heap.empty() == (expect == Heap::npos), "empty", step);
+      if(expect != Heap::npos) check(heap.top().handle == expect, "top", step);
+    }
+    /* drain: each erased top must be the brute-force max of the rest. */
+    while(!heap.empty()) {
+      size_t expect = bruteTop(values, active);
+      check(heap.top().handle == expect, "drain order", values.size());
+      active[expect] = false;
+      heap.erase(expect);
+    }
+  }
+  cout << "ok" << endl;
+  return 0;
+}
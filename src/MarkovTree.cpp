@@ -21,6 +21,14 @@ namespace HeteroSampler {
       max_log_prior_weight = -DBL_MAX;
       gm = nullptr;
       max_gm = nullptr;
+      max_stale = false;
+      sweep = 0;
+      sweep_changes = 0;
+      sweep_ent_change = 0;
+      stop_sweep = -1;
+      diag = nullptr;
+      stale_reads = 0;
+      blanket_reads = 0;
     }else{
       depth = parent->depth+1;
       time_stamp = parent->time_stamp;
@@ -28,10 +36,52 @@ namespace HeteroSampler {
       log_prior_weight = parent->log_prior_weight;
       max_log_prior_weight = parent->max_log_prior_weight;
       max_gm = parent->max_gm;
+      max_stale = parent->max_stale;
+      max_undo = parent->max_undo;
       gm = parent->gm;
+      sweep = parent->sweep;
+      sweep_changes = parent->sweep_changes;
+      sweep_ent_change = parent->sweep_ent_change;
+      stop_sweep = parent->stop_sweep;
+      diag = parent->diag;
+      stop_trace = parent->stop_trace;
+      stale_reads = parent->stale_reads;
+      blanket_reads = parent->blanket_reads;
+      tiles = parent->tiles;
     }
     gradient = posgrad = neggrad = nullptr;
     compute_stop = false;
+    restarts = 0;
+  }
+
+  ChainDiagnostics::ChainDiagnostics(size_t num_chains)
+  :count(num_chains, 0), mean(num_chains, 0), m2(num_chains, 0) {
+  }
+
+  void ChainDiagnostics::add(size_t k, double x) {
+    count[k]++;
+    double delta = x - mean[k];
+    mean[k] += delta / count[k];
+    m2[k] += delta * (x - mean[k]);
+  }
+
+  double ChainDiagnostics::rhat() const {
+    size_t num_chains = count.size();
+    size_t n = *std::min_element(count.begin(), count.end());
+    if(num_chains < 2 or n < 2) return DBL_MAX;
+    double W = 0, grand_mean = 0, B = 0;
+    for(size_t k = 0; k < num_chains; k++) {
+      W += m2[k] / (count[k] - 1);
+      grand_mean += mean[k];
+    }
+    W /= num_chains;
+    grand_mean /= num_chains;
+    for(size_t k = 0; k < num_chains; k++) {
+      B += (mean[k] - grand_mean) * (mean[k] - grand_mean);
+    }
+    B /= num_chains - 1;  // B / n in the usual notation.
+    if(W <= 0) return B <= 0 ? 1 : DBL_MAX;
+    return sqrt(((n - 1) / (double)n * W + B) / W);
   }
 
   bool MarkovTreeNode::is_split() {
@@ -210,7 +210,7 @@ namespace HeteroSampler {
 
   ParamPointer ModelCRFGibbs::
   proposeGibbs(Tag& tag, objcokus& rng, int pos, FeatureExtractOne feat_extract,
-               bool grad_expect, bool grad_sample, bool use_meta_feature) {
+               bool grad_expect, bool grad_sample, bool use_meta_feature, bool argmax) {
     int seqlen = tag.size();
     if(pos >= seqlen)
       throw "Gibbs sampling proposal out of bound.";
@@ -221,57 +221,64 @@ namespace HeteroSampler {
     if(use_meta_feature) {
       tag.prev_sc[pos] = tag.this_sc[pos];
       tag.oldlabels[pos] = oldval;
-      tag.oldval = oldval;
     }
 
     /* compute score */
     vector<FeaturePointer> featvec;
-    vector<double> sc(taglen);
-    auto computeSc = [&] (int i) {
-      int backup = tag.tag[i];
-      for(int t = 0; t < taglen; t++) {
-        tag.tag[i] = t;
-        FeaturePointer features = feat_extract(shared_from_this(), tag, i);
-        featvec.push_back(features);
-        sc[t] = HeteroSampler::score(this->param, features);
-      }
-      tag.tag[i] = backup;
-    };
-
-
-    computeSc(pos);
-    tag.sc = sc;
-    logNormalize(&sc[0], taglen);
-    logNormalize(&tag.sc[0], taglen);
+    vector<double> sc;
+    this->logConditional(tag, pos, feat_extract, sc, grad_expect ? &featvec : nullptr);
 
     int val;
-    val = rng.sampleCategorical(&sc[0], taglen);
+    if(argmax)
+      val = std::max_element(sc.begin(), sc.end()) - sc.begin();
+    else
+      val = rng.sampleCategorical(&sc[0], taglen);
     if(val == taglen) throw "Gibbs sample out of bound.";
     tag.tag[pos] = val;
 
     // compute statistics.
-    tag.reward[pos] = (tag.sc[val] - tag.sc[oldval]);
+    // with meta features only per-position stats are written,
+    // so positions outside each other's Markov blanket can be sampled concurrently.
+    tag.reward[pos] = (sc[val] - sc[oldval]);
     if(use_meta_feature) {
-      tag.this_sc[pos] = tag.sc;
+      tag.this_sc[pos] = sc;
       tag.prev_entropy[pos] = tag.entropy[pos];
-      tag.entropy[pos] = logEntropy(&tag.sc[0], taglen);
+      tag.entropy[pos] = logEntropy(&sc[0], taglen);
       tag.timestamp[pos] += 1;
       this->time += 1;
+    }else{
+      tag.sc = sc;
     }
 
     // compute gradient, if necessary.
-    tag.features = feat_extract(shared_from_this(), tag, pos);
     ParamPointer gradient = makeParamPointer();
-    if(grad_sample)
+    if(grad_sample) {
+      tag.features = feat_extract(shared_from_this(), tag, pos);
       mapUpdate<double, double>(*gradient, *tag.features);
+    }
     if(grad_expect) {
       for(int t = 0; t < taglen; t++) {
-        mapUpdate<double, double>(*gradient, *featvec[t], -exp(tag.sc[t]));
+        mapUpdate<double, double>(*gradient, *featvec[t], -exp(sc[t]));
       }
     }
     return gradient;
   }
 
+  void ModelCRFGibbs::logConditional(Tag& tag, int pos, FeatureExtractOne feat_extract, vec<double>& sc,
+                                     vec<FeaturePointer>* featvec) {
+    int taglen = corpus->tags.size();
+    sc.resize(taglen);
+    int backup = tag.tag[pos];
+    for(int t = 0; t < taglen; t++) {
+      tag.tag[pos] = t;
+      FeaturePointer features = feat_extract(shared_from_this(), tag, pos);
+      if(featvec) featvec->push_back(features);
+      sc[t] = HeteroSampler::score(this->localParam(), features);
+    }
+    tag.tag[pos] = backup;
+    logNormalize(&sc[0], taglen);
+  }
+
   ptr<GraphicalModel> ModelCRFGibbs::makeSample(const Instance& instance, ptr<Corpus> corpus, objcokus* rng) const {
     return std::make_shared<Tag>(&instance, corpus, rng, param);
   }
@@ -285,25 +292,36 @@ namespace HeteroSampler {
     return make_shared<Tag>(tag);
   }
 
-  void ModelCRFGibbs::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, FeatureExtractOne feat_extract, bool use_meta_feature) {
+  void ModelCRFGibbs::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, FeatureExtractOne feat_extract, bool use_meta_feature, bool argmax) {
     Tag& tag = dynamic_cast<Tag&>(gm);
     if(choice >= tag.size())
       throw "kernel choice invalid (>= tag size)";
-    this->proposeGibbs(tag, rng, choice, feat_extract, false, false, use_meta_feature);
+    this->proposeGibbs(tag, rng, choice, feat_extract, false, false, use_meta_feature, argmax);
   }
 
   void ModelCRFGibbs::sampleOneAtInit(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature) {
     this->sampleOne(gm, rng, choice, this->extractFeaturesAtInit, use_meta_feature);
   }
 
-  void ModelCRFGibbs::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature) {
-    this->sampleOne(gm, rng, choice, this->extractFeatures, use_meta_feature);
+  void ModelCRFGibbs::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature, bool argmax) {
+    this->sampleOne(gm, rng, choice, this->extractFeatures, use_meta_feature, argmax);
+  }
+
+  void ModelCRFGibbs::prefetch(const GraphicalModel& gm, int pos) const {
+    auto& tag = dynamic_cast<const Tag&>(gm);
+    HETEROSAMPLER_PREFETCH(&tag.tag[pos]);      // labels of the neighbors.
+    HETEROSAMPLER_PREFETCH(tag.seq->seq[pos].get());
+    HETEROSAMPLER_PREFETCH(&tag.this_sc[pos]);
+    HETEROSAMPLER_PREFETCH(&tag.entropy[pos]);
   }
 
   TagVector ModelCRFGibbs::sample(const Instance& seq, bool argmax) {
     TagVector vec;
     TagPtr tag = makeTagPtr(&seq, corpus, &rngs[0], param);
     for(int t = 0; t < T; t++) {
+      if(t == B and decoding != DECODE_MAX) { // accumulate marginals after burn-in.
+        tag->marginal.assign(tag->size(), std::vector<double>());
+      }
       this->sample(*tag, 1, argmax);
       if(t < B) continue;
       vec.push_back(tag);
@@ -315,7 +333,7 @@ namespace HeteroSampler {
   double ModelCRFGibbs::score(const GraphicalModel& gm) {
     auto& tag = dynamic_cast<const Tag&>(gm);
     FeaturePointer feat = this->extractFeaturesAll(tag);
-    return HeteroSampler::score(this->param, feat);
+    return HeteroSampler::score(this->localParam(), feat);
   }
 
   FeaturePointer ModelCRFGibbs::extractFeaturesAll(const Tag& tag) {
@@ -327,6 +345,8 @@ namespace HeteroSampler {
       tag.proposeGibbs(i, [&] (const Tag& tag) -> FeaturePointer {
                             return this->extractFeatures(shared_from_this(), tag, i);
                           }, false, false, argmax);
+      if(tag.marginal.size() > 0)
+        tag.accumulateMarginal(i, tag.sc);
     }
   }
 
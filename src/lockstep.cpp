@@ -0,0 +1,84 @@
+#include "lockstep.h"
+
+using namespace std;
+
+namespace HeteroSampler {
+  LockstepChains::LockstepChains(ptr<ModelCRFGibbs> model, const Instance& seq, size_t K, objcokus& rng)
+  :K(K), L(model->corpus->tags.size()), N(seq.size()), labels(N * K), sc(N * L * K, 0),
+   log_weight(K), extractions(0), model(model),
+   scratch(&seq, model->corpus, &rng, model->param),
+   prob(L * K), acc(K), coin(K), choice(K) {
+    for(size_t k = 0; k < K; k++) {  // random init, as model->makeSample.
+      Tag tag(&seq, model->corpus, &rng, model->param);
+      for(size_t pos = 0; pos < N; pos++) {
+        labels[pos * K + k] = tag.tag[pos];
+      }
+      log_weight[k] = model->score(tag);
+    }
+  }
+
+  void LockstepChains::sampleOne(int pos, objcokus& rng) {
+    vec<int> blanket = model->markovBlanket(scratch, pos);
+    std::map<vec<int>, size_t> first;  // blanket labels -> first chain with them.
+    vec<int> key(blanket.size());
+    double* sc_pos = &sc[pos * L * K];
+    for(size_t k = 0; k < K; k++) {
+      for(size_t b = 0; b < blanket.size(); b++) {
+        key[b] = labels[blanket[b] * K + k];
+      }
+      auto it = first.find(key);
+      if(it == first.end()) {
+        first[key] = k;
+        for(size_t b = 0; b < blanket.size(); b++) {
+          scratch.tag[blanket[b]] = key[b];
+        }
+        model->logConditional(scratch, pos, model->extractFeatures, cond);
+        extractions++;
+        for(size_t c = 0; c < L; c++) {
+          sc_pos[c * K + k] = cond[c];
+          prob[c * K + k] = exp(cond[c]);
+        }
+      }else{
+        size_t r = it->second;
+        for(size_t c = 0; c < L; c++) {
+          sc_pos[c * K + k] = sc_pos[c * K + r];
+          prob[c * K + k] = prob[c * K + r];
+        }
+      }
+    }
+
+    /* inverse cdf draws of all chains, branch-free over k */
+    for(size_t k = 0; k < K; k++) {
+      coin[k] = rng.random01();
+      acc[k] = 0;
+      choice[k] = 0;
+    }
+    for(size_t c = 0; c < L; c++) {
+      const double* p = &prob[c * K];
+      for(size_t k = 0; k < K; k++) {
+        acc[k] += p[k];
+        choice[k] += acc[k] <= coin[k];
+      }
+    }
+    int* label = &labels[pos * K];
+    for(size_t k = 0; k < K; k++) {
+      int val = min(choice[k], (int)L - 1);
+      log_weight[k] += sc_pos[val * K + k] - sc_pos[label[k] * K + k];
+      label[k] = val;
+    }
+  }
+
+  void LockstepChains::sweep(objcokus& rng) {
+    for(size_t pos = 0; pos < N; pos++) {
+      this->sampleOne(pos, rng);
+    }
+  }
+
+  ptr<Tag> LockstepChains::chain(size_t k) const {
+    auto tag = std::make_shared<Tag>(scratch);
+    for(size_t pos = 0; pos < N; pos++) {
+      tag->tag[pos] = this->getLabel(pos, k);
+    }
+    return tag;
+  }
+}
@@ -37,6 +37,20 @@ namespace HeteroSampler {
       cout << warn << " - use accuracy" << endl;
       scoring = SCORING_ACCURACY;
     }
+    if(vm.count("decode") == 0) {
+      decoding = DECODE_MAX;
+    }else{
+      this->parseDecoding(vm["decode"].as<string>());
+    }
+    if(corpus != nullptr) {
+      size_t taglen = corpus->tags.size();
+      transitions.resize(taglen + 1, vec<bool>(taglen, false));
+      for(const SentencePtr seq : corpus->seqs) {
+        for(size_t i = 0; i < seq->tag.size(); i++) {
+          transitions[i == 0 ? taglen : seq->tag[i-1]][seq->tag[i]] = true;
+        }
+      }
+    }
     rngs.resize(K);
     if(!vm["log"].empty() and vm["log"].as<string>() != "") {
       try{
@@ -91,10 +105,9 @@ namespace HeteroSampler {
   }
 
   tuple<int, int> Model::evalPOS(const Tag& tag) {
-    Tag truth(*tag.seq, corpus, &rngs[0], param);
     int hit_count = 0, pred_count = 0;
-    for(int i = 0; i < truth.size(); i++) {
-      if(tag.tag[i] == truth.tag[i]) {
+    for(int i = 0; i < tag.size(); i++) {
+      if(tag.tag[i] == tag.seq->tag[i]) {
         hit_count++;
       }
       pred_count++;
@@ -156,6 +169,138 @@ namespace HeteroSampler {
     return make_tuple(hit_count, pred_count, truth_count);
   }
 
+  static bool chunkBegin(const Model::EvalTable& table, const vec<int>& labels, size_t pos) {
+    int tg = labels[pos];
+    char tg_ch = table.label_ch[tg], prev_tg_ch = pos > 0 ? table.label_ch[labels[pos-1]] : 'O';
+    return (prev_tg_ch == 'B' && tg_ch == 'B') ||
+           (prev_tg_ch == 'I' && tg_ch == 'B') ||
+           (prev_tg_ch == 'O' && tg_ch == 'B') ||
+           (prev_tg_ch == 'O' && tg_ch == 'I') ||
+           (prev_tg_ch == 'E' && tg_ch == 'E') ||
+           (prev_tg_ch == 'E' && tg_ch == 'I') ||
+           (prev_tg_ch == 'O' && tg_ch == 'E') ||
+           (table.label_chunk[tg] && table.type_begin[pos]) ||
+           table.label_bracket[tg];
+  }
+
+  static bool chunkEnd(const Model::EvalTable& table, const vec<int>& labels, size_t pos) {
+    int tg = labels[pos];
+    char tg_ch = table.label_ch[tg], next_tg_ch = pos + 1 < labels.size() ? table.label_ch[labels[pos+1]] : 'O';
+    return (tg_ch == 'B' && next_tg_ch == 'B') ||
+           (tg_ch == 'B' && next_tg_ch == 'O') ||
+           (tg_ch == 'I' && next_tg_ch == 'B') ||
+           (tg_ch == 'I' && next_tg_ch == 'O') ||
+           (tg_ch == 'E' && next_tg_ch == 'E') ||
+           (tg_ch == 'E' && next_tg_ch == 'I') ||
+           (tg_ch == 'E' && next_tg_ch == 'O') ||
+           (table.label_chunk[tg] && table.type_end[pos]) ||
+           table.label_bracket[tg];
+  }
+
+  ptr<Model::EvalTable> Model::makeEvalTable(const Instance& seq, bool chunks) {
+    auto table = make_shared<EvalTable>();
+    table->chunks = chunks;
+    table->truth = seq.tag;
+    if(!chunks) return table;
+    for(const string& tg : corpus->invtags) {
+      table->label_ch.push_back(tg[0]);
+      table->label_chunk.push_back(tg != "O" && tg != ".");
+      table->label_bracket.push_back(tg == "[" || tg == "]");
+    }
+    size_t seqlen = seq.seq.size();
+    auto type = [&] (size_t pos) { return cast<TokenLiteral>(seq.seq[pos])->pos; };
+    for(size_t pos = 0; pos < seqlen; pos++) {
+      table->type_begin.push_back(type(pos) != (pos > 0 ? type(pos-1) : ""));
+      table->type_end.push_back(type(pos) != (pos + 1 < seqlen ? type(pos+1) : ""));
+    }
+    for(size_t pos = 0; pos < seqlen; pos++) {
+      table->truth_begin.push_back(chunkBegin(*table, table->truth, pos));
+      table->truth_end.push_back(chunkEnd(*table, table->truth, pos));
+    }
+    return table;
+  }
+
+  tuple<int, int, int> Model::evalLabels(const EvalTable& table, const vec<int>& labels) {
+    int hit_count = 0, pred_count = 0, truth_count = 0;
+    if(!table.chunks) {
+      for(size_t i = 0; i < labels.size(); i++) {
+        hit_count += (int)(labels[i] == table.truth[i]);
+        pred_count++;
+      }
+      return make_tuple(hit_count, pred_count, truth_count);
+    }
+    bool hit_begin = true;
+    for(size_t i = 0; i < labels.size(); i++) {
+      bool pred_begin = chunkBegin(table, labels, i);
+      truth_count += (int)table.truth_begin[i];
+      pred_count += (int)pred_begin;
+      if(table.truth_begin[i] && pred_begin)
+        hit_begin = true;
+      if(labels[i] != table.truth[i]) {
+        hit_begin = false;
+      }
+      if(table.truth_end[i] && chunkEnd(table, labels, i)) {
+        hit_count += (int)hit_begin;
+      }
+    }
+    return make_tuple(hit_count, pred_count, truth_count);
+  }
+
+  void Model::decodeMarginal(GraphicalModel& gm) {
+    if(gm.marginal.size() != gm.size()) return; // nothing sampled yet.
+    size_t seqlen = gm.size();
+    // probability that label <t> at <pos> is a hit. a position never sampled counts its current label.
+    auto marginal = [&] (int pos, int t) {
+      const vec<double>& m = gm.marginal[pos];
+      if(m.size() == 0) return t == gm.getLabel(pos) ? 1.0 : 0.0;
+      double total = 0;
+      for(double v : m) total += v;
+      return total > 0 ? m[t] / total : 0.0;
+    };
+    auto decodeMaxMarginal = [&] () {
+      for(size_t pos = 0; pos < seqlen; pos++) {
+        const vec<double>& m = gm.marginal[pos];
+        if(m.size() == 0) continue;
+        gm.setLabel(pos, std::max_element(m.begin(), m.end()) - m.begin());
+      }
+    };
+    size_t taglen = transitions.size() > 0 ? transitions.size() - 1 : 0;
+    if(decoding != DECODE_MBR or seqlen == 0 or taglen != gm.numLabels(0)) {
+      decodeMaxMarginal();
+      return;
+    }
+    // viterbi over the sum of marginals (expected hits), restricted to transitions seen in training.
+    // -DBL_MAX marks labels no consistent path reaches.
+    vec2d<double> best(seqlen, vec<double>(taglen, -DBL_MAX));
+    vec2d<int> back(seqlen, vec<int>(taglen, -1));
+    for(size_t t = 0; t < taglen; t++) {
+      if(transitions[taglen][t]) best[0][t] = marginal(0, t);
+    }
+    for(size_t pos = 1; pos < seqlen; pos++) {
+      for(size_t t = 0; t < taglen; t++) {
+        double m = marginal(pos, t);
+        for(size_t s = 0; s < taglen; s++) {
+          if(!transitions[s][t] or best[pos-1][s] == -DBL_MAX) continue;
+          double sc = best[pos-1][s] + m;
+          if(sc > best[pos][t]) {
+            best[pos][t] = sc;
+            back[pos][t] = s;
+          }
+        }
+      }
+    }
+    const vec<double>& last = best[seqlen-1];
+    int t = std::max_element(last.begin(), last.end()) - last.begin();
+    if(last[t] == -DBL_MAX) { // no consistent path, fall back to max marginals.
+      decodeMaxMarginal();
+      return;
+    }
+    for(int pos = seqlen-1; pos >= 0; pos--) {
+      gm.setLabel(pos, t);
+      t = back[pos][t];
+    }
+  }
+
   double Model::test(ptr<Corpus> test_corpus) {
     test_corpus->retag(this->corpus);
     int pred_count = 0, truth_count = 0, hit_count = 0;
@@ -165,12 +310,17 @@ namespace HeteroSampler {
       TagVector tags = this->sample(*seq, false);
       double max_lhood = -DBL_MAX;
       shared_ptr<Tag> tag = tags.back();
-      for(shared_ptr<Tag> this_tag : tags) {
-        double sc = this->score(*this_tag);
-        if(sc > max_lhood) {
-          max_lhood = sc;
-          tag = this_tag;
+      if(decoding == DECODE_MAX) {
+        for(shared_ptr<Tag> this_tag : tags) {
+          double sc = this->score(*this_tag);
+          if(sc > max_lhood) {
+            max_lhood = sc;
+            tag = this_tag;
+          }
         }
+      }else{
+        tag = makeTagPtr(*tag);
+        this->decodeMarginal(*tag);
       }
       Tag truth(*seq, corpus, &rngs[0], param);
       xmllog->begin("example_"+to_string(ex));
@@ -210,11 +360,36 @@ namespace HeteroSampler {
     return -1;
   }
 
+  vec<vec<int> > Model::colorGraph(const GraphicalModel& gm) {
+    size_t size = gm.size();
+    vec<int> color(size, -1);
+    vec<vec<int> > classes;
+    vec<size_t> taken;  // taken[c] == pos if colour c is used by a neighbor of pos.
+    for(size_t pos = 0; pos < size; pos++) {
+      auto mark = [&] (const vec<int>& blanket) {
+        for(int id : blanket) {
+          if(color[id] >= 0) taken[color[id]] = pos;
+        }
+      };
+      mark(this->markovBlanket(gm, pos));
+      mark(this->invMarkovBlanket(gm, pos));
+      size_t c = 0;
+      while(c < classes.size() and taken[c] == pos) c++;
+      if(c == classes.size()) {
+        classes.push_back(vec<int>());
+        taken.push_back(-1);
+      }
+      color[pos] = c;
+      classes[c].push_back(pos);
+    }
+    return classes;
+  }
+
   void Model::sample(Tag& tag, int time, bool argmax) {
     tag = *this->sample(*tag.seq, argmax).back();
   }
 
-  void Model::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature) {
+  void Model::sampleOne(GraphicalModel& gm, objcokus& rng, int choice, bool use_meta_feature, bool argmax) {
     throw "custom kernel choice not implemented.";
   }
 
@@ -9,6 +9,9 @@
 
 #define USE_WINDOW 0
 
+#define DEADLINE_CHECK_STEPS 16   // steps between reads of the clock in deadline mode.
+#define COST_CALIBRATION_STEPS 32 // steps measured before a budget is converted to seconds.
+
 namespace po = boost::program_options;
 
 using namespace std;
@@ -18,8 +21,21 @@ namespace HeteroSampler {
 Policy::Policy(ModelPtr model, const po::variables_map& vm)
   : model(model), 
     test_thread_pool(vm["numThreads"].as<size_t>(),
-                     [ & ] (int tid, MarkovTreeNodePtr node) {
-                        this->sample(tid, node);
+                     [ & ] (int tid, const vec<MarkovTreeNodePtr>& nodes) {
+                        auto start = std::chrono::steady_clock::now();
+                        if (this->numa_node.size() > 0) this->placeOnNode(tid, nodes);
+                        if (nodes.size() == 1) {
+                          this->sample(tid, nodes[0]);
+                        } else {
+                          this->sampleInterleaved(tid, nodes);
+                        }
+                        if (this->numa_node.size() > 0) {
+                          for (auto node : nodes) this->numa_samples[tid] += node->depth;
+                          this->numa_busy[tid] += std::chrono::duration<double>(
+                                                    std::chrono::steady_clock::now() - start).count();
+                        }
+                        if (this->test_stream == nullptr) return;
+                        for (auto node : nodes) this->test_stream->finish(node.get());
                      }),
     thread_pool(vm["numThreads"].as<size_t>(),
                     [ & ] (int tid, MarkovTreeNodePtr node) {
@@ -39,6 +55,22 @@ Policy::Policy(ModelPtr model, const po::variables_map& vm)
     Q(vm["Q"].empty() ? 1 : vm["Q"].as<size_t>()),
     lets_inplace(vm["inplace"].empty() ? true : vm["inplace"].as<bool>()),
     init_method(vm["init"].empty() ? "" : vm["init"].as<string>()),
+    icm(vm["icm"].empty() or vm["icm"].as<double>() < 0 ? -1
+        : vm["icm"].as<double>() * (vm["T"].empty() ? 1 : vm["T"].as<size_t>())),
+    converge(vm["converge"].empty() ? false : vm["converge"].as<bool>()),
+    converge_change(vm["converge_change"].empty() ? 0 : vm["converge_change"].as<double>()),
+    converge_ent(vm["converge_ent"].empty() ? 0.01 : vm["converge_ent"].as<double>()),
+    converge_rhat(vm["converge_rhat"].empty() ? 1.1 : vm["converge_rhat"].as<double>()),
+    schedule(vm["schedule"].empty() ? "fifo" : vm["schedule"].as<string>()),
+    interleave(vm["interleave"].empty() ? 1 : max((size_t)1, vm["interleave"].as<size_t>())),
+    lockstep(vm["lockstep"].empty() ? false : vm["lockstep"].as<bool>()),
+    numa(vm["numa"].empty() ? false : vm["numa"].as<bool>()),
+    learn_stop(vm["learn_stop"].empty() ? false : vm["learn_stop"].as<bool>()),
+    sync_every(vm["sync_every"].empty() ? 0 : vm["sync_every"].as<size_t>()),
+    lets_resp_reward(!vm["record"].empty() and vm["record"].as<string>() != ""),
+    record_path(lets_resp_reward ? vm["record"].as<string>() : ""),
+    record_size(vm["record_size"].empty() ? 100000 : vm["record_size"].as<size_t>()),
+    lean(false),
     param(makeParamPointer()), G2(makeParamPointer()) {
 
   // parse other options
@@ -125,9 +157,42 @@ Policy::Policy(ModelPtr model, const po::variables_map& vm)
     add_feat(key);
   }
 
+  // dense columns for the meta-features with one fixed name.
+  feat_slot.resize(FEAT_COUNT, -1);
+  for(MetaFeature f : this->feat) {
+    if(f == FEAT_SP_COND_ENT or f == FEAT_SP_UNIGRAM_ENT or f == FEAT_NB_DISCORD) continue;
+    if(feat_slot[f] < 0) feat_slot[f] = weight.size();
+    weight.resize(max(weight.size(), (size_t)feat_slot[f] + 1), 0);
+  }
+  discord_labels = 0;
+  for (size_t tid = 0; tid < thread_pool.numThreads(); tid++) {
+    thread_grad.push_back(makeParamPointer());
+  }
+
   split(verbose_opt, vm["verbosity"].as<string>(), boost::is_any_of(" "));
 
   int sysres = system(("mkdir -p " + name).c_str());
+
+  if (numa) { // pin test threads to nodes in contiguous blocks.
+    size_t num_threads = test_thread_pool.numThreads();
+    for (size_t tid = 0; tid < num_threads; tid++) {
+      numa_node.push_back(numa_topo.nodeOf(tid, num_threads));
+      if (!pinThread(test_thread_pool.nativeHandle(tid), numa_topo.cpus[numa_node.back()])) {
+        cout << "warning: failed to pin test thread " << tid << endl;
+      }
+    }
+    numa_samples.resize(num_threads, 0);
+    numa_busy.resize(num_threads, 0);
+  }
+}
+
+void Policy::placeOnNode(int tid, const vec<MarkovTreeNodePtr>& nodes) {
+  currentNumaNode() = numa_node[tid];
+  for (auto node : nodes) { // chain state is first touched by this thread, so it lives on its node.
+    if (isinstance<ModelCRFGibbs>(model)) {
+      node->gm = model->copySample(*node->gm);
+    }
+  }
 }
 
 Policy::~Policy() {
@@ -141,13 +206,13 @@ double Policy::delayedReward(MarkovTreeNodePtr node, int depth, int maxdepth, ve
     id = actions[depth];
   } else { // sample new action.
     if (depth == 0) { //sample uniformly.
-      id = int(rng.random01() * (1 - 1e-8) * node->gm->size());
+      id = int(node->gm->rng->random01() * (1 - 1e-8) * node->gm->size());
     } else {
       vec<int> blanket = model->markovBlanket(*node->gm, actions[depth - 1]);
       if (blanket.size() == 0) {
         id = actions[depth - 1];
       } else {
-        id = blanket[int(rng.random01() * (1 - 1e-8) *  blanket.size())];
+        id = blanket[int(node->gm->rng->random01() * (1 - 1e-8) *  blanket.size())];
       }
     }
     actions.push_back(id);
@@ -155,7 +220,7 @@ double Policy::delayedReward(MarkovTreeNodePtr node, int depth, int maxdepth, ve
   int num_label = node->gm->numLabels(id);
   int oldval = node->gm->getLabel(id);
   double R = 0;
-  model->sampleOne(*node->gm, rng, id, false);
+  model->sampleOne(*node->gm, *node->gm->rng, id, false);
   R = node->gm->sc[node->gm->getLabel(id)] - node->gm->sc[oldval];
   if (depth < maxdepth) {
     R += this->delayedReward(node, depth + 1, maxdepth, actions);
@@ -175,17 +240,11 @@ double Policy::sampleDelayedReward(MarkovTreeNodePtr node, int id, int maxdepth,
 
 void Policy::sample(int tid, MarkovTreeNodePtr node) {
   node->depth = 0;
+  node->restarts++;
   objcokus& rng = test_thread_pool.rngs[tid];
   node->gm->rng = &rng;
   try {
-    if (this->init_method == "iid") {
-      for (size_t pos = 0; pos < node->gm->size(); pos++) {
-        model->sampleOneAtInit(*node->gm, rng, pos);
-        node->depth++;
-        node->gm->mask[pos] += 1;
-      }
-      node->max_gm = model->copySample(*node->gm);
-    }
+    this->sampleInit(node, rng);
     while (true) {
       node->choice = this->policy(node);
       if (node->choice.type == Location::LOC_NULL) {
@@ -204,8 +263,74 @@ void Policy::sample(int tid, MarkovTreeNodePtr node) {
   }
 }
 
+void Policy::sampleInterleaved(int tid, const vec<MarkovTreeNodePtr>& nodes) {
+  objcokus& rng = test_thread_pool.rngs[tid];
+  vec<MarkovTreeNodePtr> live;
+  vec<Location> next;
+  auto finish = [&] (MarkovTreeNodePtr node) {
+    node->log_weight = model->score(*node->gm);
+    node->gradient = makeParamPointer();
+  };
+  for (auto node : nodes) {
+    node->depth = 0;
+    node->restarts++;
+    node->gm->rng = &rng;
+    try {
+      this->sampleInit(node, rng);
+      live.push_back(node);
+      next.push_back(this->policy(node));
+    } catch (const char* ee) {
+      cout << "error: " << ee << endl;
+    }
+  }
+  while (live.size() > 0) {
+    for (size_t i = 0; i < live.size(); ) {
+      MarkovTreeNodePtr node = live[i];
+      try {
+        node->choice = next[i];
+        if (node->choice.type == Location::LOC_NULL) {
+          finish(node);
+          live[i] = live.back(); live.pop_back();
+          next[i] = next.back(); next.pop_back();
+          continue;
+        }
+        size_t j = (i + 1) % live.size();
+        if (next[j].type != Location::LOC_NULL) {
+          model->prefetch(*live[j]->gm, next[j].pos);
+        }
+        node->log_weight = -DBL_MAX;
+        int pos = node->choice.pos;
+        this->sampleOne(node, rng, pos);
+        this->updateResp(node, rng, pos, nullptr);
+        next[i] = this->policy(node);
+        i++;
+      } catch (const char* ee) {
+        cout << "error: " << ee << endl;
+        live[i] = live.back(); live.pop_back();
+        next[i] = next.back(); next.pop_back();
+      }
+    }
+  }
+}
+
+void Policy::sampleInit(MarkovTreeNodePtr node, objcokus& rng) {
+  if (this->init_method == "iid") {
+    for (size_t pos = 0; pos < node->gm->size(); pos++) {
+      model->sampleOneAtInit(*node->gm, rng, pos);
+      node->depth++;
+      node->gm->time++;
+      node->gm->mask[pos] += 1;
+    }
+    node->max_gm = model->copySample(*node->gm);
+  }
+}
+
 void Policy::train(ptr<Corpus> corpus) {
   lg->begin("train");
+  if (lets_resp_reward) {
+    recorder = std::make_shared<ExampleRecorder>(record_path, record_size);
+    recorder->start(param);
+  }
   /* train the model */
   if (Q > 0)
     *auxlg << "start training ... " << endl;
@@ -225,10 +350,10 @@ void Policy::train(ptr<Corpus> corpus) {
   }
   /* log policy examples */
   if (lets_resp_reward) {
+    recorder->close();
     lg->begin("policy_example");
-    for (auto example : this->examples) {
-      example.serialize(lg);
-    }
+    *lg << recorder->path << ": " << recorder->size() << " of " << recorder->seen()
+        << " examples, " << recorder->version() << " param versions" << endl;
     lg->end(); // </policy_example>
   }
   lg->begin("param");
@@ -240,43 +365,61 @@ void Policy::train(ptr<Corpus> corpus) {
 void Policy::train_policy(ptr<Corpus> corpus) {
   lg->begin("commit"); *lg << getGitHash() << endl; lg->end();
   corpus->retag(model->corpus);
-  size_t count = 0;
-  examples.clear();
-  for (const SentencePtr seq : corpus->seqs) {
-    if (count >= train_count) break;
-    // cout << corpus->seqs.size() << endl;
-    size_t display_lag = int(0.1 * min(train_count, corpus->seqs.size()));
-    if (display_lag == 0 or count % display_lag == 0)
-      *auxlg << "\t\t " << (double)count / corpus->seqs.size() * 100 << " %" << endl;
+  size_t num_seqs = min(train_count, corpus->seqs.size());
+  size_t batch = sync_every > 0 ? sync_every : 1;  // sentences in flight between merges.
+  size_t display_lag = int(0.1 * num_seqs);
+  for (size_t first = 0; first < num_seqs; first += batch) {
     if (verbose)
-      lg->begin("example_" + to_string(count));
-    MarkovTree tree;
-    ptr<GraphicalModel> gm = model->makeSample(*seq, model->corpus, &rng);
-    tree.root->log_weight = -DBL_MAX;
-    tree.root->model = this->model;
-    for (size_t k = 0; k < K; k++) {
-      MarkovTreeNodePtr node = addChild(tree.root, *gm);
-      this->thread_pool.addWork(node);
+      lg->begin("example_" + to_string(first));
+    vec<MarkovTree> trees(min(batch, num_seqs - first));
+    vec<MarkovTreeNodePtr> nodes;
+    for (size_t b = 0; b < trees.size(); b++) {
+      size_t count = first + b;
+      if (display_lag == 0 or count % display_lag == 0)
+        *auxlg << "\t\t " << (double)count / corpus->seqs.size() * 100 << " %" << endl;
+      ptr<GraphicalModel> gm = model->makeSample(*corpus->seqs[count], model->corpus, &rng);
+      trees[b].root->log_weight = -DBL_MAX;
+      trees[b].root->model = this->model;
+      for (size_t k = 0; k < K; k++) {
+        nodes.push_back(addChild(trees[b].root, *gm));
+        if (learn_stop) nodes.back()->stop_trace = std::make_shared<StopTrace>();
+      }
     }
+    thread_pool.addWork(nodes.begin(), nodes.end());
     thread_pool.waitFinish();
+    if (sync_every > 0) this->mergeGradients();
+    if (learn_stop) {
+      for (auto node : nodes) {
+        this->trainStop(*node->stop_trace);
+      }
+    }
 
     /* log nodes */
     if (verbose) {
-      for (size_t k = 0; k < K; k++) {
-        MarkovTreeNodePtr node = tree.root->children[k];
-        while (node->children.size() > 0) node = node->children[0]; // take final sample.
-        lg->begin("node");
-        this->logNode(node);
-        lg->end(); // </node>
+      for (const MarkovTree& tree : trees) {
+        for (size_t k = 0; k < K; k++) {
+          MarkovTreeNodePtr node = tree.root->children[k];
+          while (node->children.size() > 0) node = node->children[0]; // take final sample.
+          lg->begin("node");
+          this->logNode(node);
+          lg->end(); // </node>
+        }
       }
       lg->begin("param");
       *lg << *param;
       lg->end(); // </param>
-    }
-    if (verbose) {
       lg->end(); // </example>
     }
-    count++;
+  }
+}
+
+void Policy::mergeGradients() {
+  for (ParamPointer grad : thread_grad) {
+    if (grad->size() == 0) continue;
+    adagrad(param, G2, grad, eta);
+    this->syncWeights(grad);
+    if (lets_resp_reward) recorder->commit(grad, param);
+    grad->clear();
   }
 }
 
@@ -286,14 +429,17 @@ Policy::Result::Result(ptr<Corpus> corpus)
   nodes.clear();
   time = 0;
   wallclock = 0;
+  cputime = 0;
   wallclock_sample = 0;
   wallclock_policy = 0;
+  hit_count = pred_count = truth_count = 0;
 }
 
 Policy::ResultPtr Policy::test(ptr<Corpus> testCorpus) {
   Policy::ResultPtr result = makeResultPtr(testCorpus);
   result->corpus->retag(model->corpus);
   result->nodes.resize(min(test_count, testCorpus->seqs.size()), nullptr);
+  result->stop_sweep.resize(result->nodes.size(), -1);
   result->time = 0;
   result->wallclock = 0;
   test(result);
@@ -312,15 +458,18 @@ void Policy::test(Policy::ResultPtr result) {
 
 void Policy::test_policy(Policy::ResultPtr result) {
   assert(result != nullptr);
+  this->syncWeights();
   size_t count = 0;
   clock_t time_start = clock(), time_end;
+  auto wall_start = std::chrono::steady_clock::now();
 
   lg->begin("example");
   count = 0;
   double hit_count = 0, pred_count = 0, truth_count = 0;
   double ave_time = 0;
-  vector<MarkovTreeNodePtr> stack;
-  vector<int> id;
+  size_t stale_reads = 0, blanket_reads = 0;
+  /* create the chains in corpus order, so they do not depend on scheduling */
+  vector<MarkovTreeNodePtr> nodes;
   for (const SentencePtr seq : result->corpus->seqs) {
     if (count >= test_count) break;
     MarkovTreeNodePtr node;
@@ -329,49 +478,98 @@ void Policy::test_policy(Policy::ResultPtr result) {
       node->model = model;
       node->gm = model->makeSample(*seq, model->corpus, &rng);
       node->log_prior_weight = model->score(*node->gm);
+      if (converge and K > 1) { // auxiliary chains for R-hat.
+        node->diag = make_shared<ChainDiagnostics>(K);
+        if (lockstep and isinstance<ModelCRFGibbs>(model)) {
+          node->diag->lockstep = std::make_shared<LockstepChains>(cast<ModelCRFGibbs>(model), *seq, K - 1, rng);
+          node->diag->aux_log_weight = node->diag->lockstep->log_weight;
+        }
+        for (size_t k = 1; k < K and node->diag->lockstep == nullptr; k++) {
+          node->diag->aux.push_back(model->makeSample(*seq, model->corpus, &rng));
+          node->diag->aux_log_weight.push_back(model->score(*node->diag->aux.back()));
+        }
+      }
     } else {
       node = result->nodes[count];
     }
-    stack.push_back(node);
-    id.push_back(count);
-    test_thread_pool.addWork(node);
+    nodes.push_back(node);
     count++;
-    if (count % thread_pool.numThreads() == 0 || count == test_count
-        || count == result->corpus->seqs.size()) {
-      test_thread_pool.waitFinish();
-      for (size_t i = 0; i < id.size(); i++) {
-        MarkovTreeNodePtr node = stack[i];
-        lg->begin("example_" + to_string(id[i]));
-        this->logNode(node);
-        while (node->children.size() > 0) node = node->children[0]; // take final sample.
-        result->nodes[id[i]] = node;
-        ave_time += node->depth;
-        if (model->scoring == Model::SCORING_ACCURACY) {
-          tuple<int, int> hit_pred = model->evalPOS(*cast<Tag>(node->max_gm));
-          hit_count += get<0>(hit_pred);
-          pred_count += get<1>(hit_pred);
-        } else if (model->scoring == Model::SCORING_NER) {
-          tuple<int, int, int> hit_pred_truth = model->evalNER(*cast<Tag>(node->max_gm));
-          hit_count += get<0>(hit_pred_truth);
-          pred_count += get<1>(hit_pred_truth);
-          truth_count += get<2>(hit_pred_truth);
-        } else if (model->scoring == Model::SCORING_LHOOD) {
-          hit_count += model->score(*node->max_gm);
-          pred_count++;
-        }
-        lg->end(); // </example_i>
-      }
-      stack.clear();
-      id.clear();
+  }
+
+  /* workers pull chains without barriers, while this thread logs and
+   * evaluates them in corpus order as they finish. */
+  vector<MarkovTreeNodePtr> order = nodes;
+  if (schedule == "longest") {
+    std::stable_sort(order.begin(), order.end(), [] (MarkovTreeNodePtr a, MarkovTreeNodePtr b) {
+      return a->gm->size() > b->gm->size();
+    });
+  } else if (schedule != "fifo") {
+    throw "unrecognized schedule.";
+  }
+  test_stream = std::make_shared<TestStream>(nodes);
+  vec<vec<MarkovTreeNodePtr> > groups;
+  for (size_t i = 0; i < order.size(); i += interleave) {
+    groups.push_back(vec<MarkovTreeNodePtr>(order.begin() + i,
+                                            order.begin() + min(i + interleave, order.size())));
+  }
+  if (numa) { // deal groups round-robin over nodes, and over the threads of a node.
+    std::fill(numa_samples.begin(), numa_samples.end(), 0);
+    std::fill(numa_busy.begin(), numa_busy.end(), 0);
+    model->param_replica.clear();
+    for (size_t n = 0; n < numa_topo.numNodes(); n++) {
+      model->param_replica.push_back(replicateOnNode(model->param, numa_topo, n));
     }
+    vec<vec<size_t> > threads(numa_topo.numNodes());
+    for (size_t tid = 0; tid < numa_node.size(); tid++) threads[numa_node[tid]].push_back(tid);
+    vec<size_t> next(threads.size(), 0);
+    for (size_t i = 0, n = 0; i < groups.size(); i++, n = (n + 1) % threads.size()) {
+      while (threads[n].size() == 0) n = (n + 1) % threads.size();
+      test_thread_pool.addWorkTo(threads[n][next[n]++ % threads[n].size()], groups[i]);
+    }
+  } else {
+    test_thread_pool.addWork(groups.begin(), groups.end());
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    test_stream->wait(i);
+    MarkovTreeNodePtr node = nodes[i];
+    lg->begin("example_" + to_string(i));
+    this->logNode(node);
+    while (node->children.size() > 0) node = node->children[0]; // take final sample.
+    result->nodes[i] = node;
+    if (i < result->stop_sweep.size()) {
+      result->stop_sweep[i] = node->stop_sweep;
+    }
+    if (converge or learn_stop) {
+      lg->begin("stop_sweep");
+      *lg << node->stop_sweep << endl;
+      lg->end(); // </stop_sweep>
+    }
+    ave_time += node->depth;
+    stale_reads += node->stale_reads;
+    blanket_reads += node->blanket_reads;
+    tuple<double, double, double> hit_pred_truth = this->evaluate(result, i, node);
+    hit_count += get<0>(hit_pred_truth);
+    pred_count += get<1>(hit_pred_truth);
+    truth_count += get<2>(hit_pred_truth);
+    lg->end(); // </example_i>
+  }
+  test_thread_pool.waitFinish();
+  test_stream = nullptr;
+  if (numa) {
+    model->param_replica.clear();
+    this->logNuma();
   }
   lg->end(); // </example>
   /* log summary stats */
   time_end = clock();
   double accuracy = (double)hit_count / pred_count;
   double recall = (double)hit_count / truth_count;
+  result->hit_count = hit_count;
+  result->pred_count = pred_count;
+  result->truth_count = truth_count;
   result->time += (double)ave_time / count;
-  result->wallclock += (double)(time_end - time_start) / CLOCKS_PER_SEC;
+  result->cputime += (double)(time_end - time_start) / CLOCKS_PER_SEC;
+  result->wallclock += std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
   lg->begin("time");
   *auxlg << "time: " << result->time << endl;
   *lg << result->time << endl;
@@ -380,6 +578,16 @@ void Policy::test_policy(Policy::ResultPtr result) {
   *auxlg << "wallclock: " << result->wallclock << endl;
   *lg << result->wallclock << endl;
   lg->end(); // </wallclock>
+  lg->begin("cputime");
+  *lg << result->cputime << endl;
+  lg->end(); // </cputime>
+  if (blanket_reads > 0) {
+    double staleness = (double)stale_reads / blanket_reads;
+    lg->begin("staleness");
+    *auxlg << "staleness: " << staleness << endl;
+    *lg << staleness << endl;
+    lg->end(); // </staleness>
+  }
   if (model->scoring == Model::SCORING_ACCURACY) {
     lg->begin("accuracy");
     *lg << accuracy << endl;
@@ -403,17 +611,40 @@ void Policy::test_policy(Policy::ResultPtr result) {
   // result->score = -1;
 }
 
-FeaturePointer Policy::extractFeatures(MarkovTreeNodePtr node, int pos) {
+void Policy::logNuma() {
+  lg->begin("numa");
+  for (size_t n = 0; n < numa_topo.numNodes(); n++) {
+    size_t samples = 0;
+    double busy = 0;
+    for (size_t tid = 0; tid < numa_node.size(); tid++) {
+      if (numa_node[tid] != (int)n) continue;
+      samples += numa_samples[tid];
+      busy += numa_busy[tid];
+    }
+    double throughput = busy > 0 ? samples / busy : 0;
+    lg->begin("node_" + to_string(n));
+    *lg << samples << " samples, " << busy << " s, " << throughput << " samples/s" << endl;
+    lg->end(); // </node_n>
+    *auxlg << "numa node " << n << ": " << throughput << " samples/s" << endl;
+  }
+  lg->end(); // </numa>
+}
+
+void Policy::extractFeatures(MarkovTreeNodePtr node, int pos) {
   FeaturePointer feat = makeFeaturePointer();
   GraphicalModel& gm = *node->gm;
   size_t seqlen = gm.size();
   const Instance& seq = *gm.seq;
+  if (gm.meta_stride != weight.size() or gm.meta.size() != seqlen * weight.size()) {
+    gm.meta_stride = weight.size();
+    gm.meta.assign(seqlen * gm.meta_stride, 0);
+  }
+  double* row = gm.metaRow(pos);
   
   for(MetaFeature f : this->feat) {
 
-    string name = feat_name[f];
     auto add_feat = [&] (double value) {
-      insertFeature(feat, name, value);
+      row[feat_slot[f]] = value;
     };
 
     auto unigram_ent = [&] () {
@@ -491,8 +722,18 @@ FeaturePointer Policy::extractFeatures(MarkovTreeNodePtr node, int pos) {
                       boost::lexical_cast<string>(node->gm->mask[pos]) + "-unigram-ent", 
                       node->gm->entropy_unigram[pos]);
         break;
-      case FEAT_NB_VARY:
       case FEAT_NB_DISCORD:
+        // a count per label of the neighbours, added dynamically.
+        if (gm.discord_stride == 0 or gm.discord.size() != seqlen * gm.discord_stride) {
+          gm.discord_stride = 0;
+          for (size_t i = 0; i < seqlen; i++) {
+            gm.discord_stride = max(gm.discord_stride, gm.numLabels(i));
+          }
+          gm.discord.assign(seqlen * gm.discord_stride, 0);
+        }
+        std::fill(gm.discordRow(pos), gm.discordRow(pos) + gm.discord_stride, 0);
+        break;
+      case FEAT_NB_VARY:
       case FEAT_ORACLE:
       case FEAT_ORACLE_ENT:
       case FEAT_ORACLE_STALENESS:
@@ -503,17 +744,105 @@ FeaturePointer Policy::extractFeatures(MarkovTreeNodePtr node, int pos) {
         throw "unrecognized meta-feature";
     }
   }
+  gm.feat[pos] = feat;
+}
+
+double Policy::response(const GraphicalModel& gm, int pos) const {
+  const double* row = gm.metaRow(pos);
+  double ret = 0;
+  for (size_t k = 0; k < weight.size(); k++) {
+    ret += weight[k] * row[k];
+  }
+  if (gm.discord_stride > 0) {
+    const double* discord = gm.discordRow(pos);
+    int yourval = gm.getLabel(pos);
+    for (size_t val = 0; val < gm.discord_stride; val++) {
+      if (discord[val] != 0) ret += discord[val] * discordWeight(yourval, val);
+    }
+  }
+  return ret + HeteroSampler::score(param, gm.feat[pos]);
+}
+
+FeaturePointer Policy::featureList(const GraphicalModel& gm, int pos) const {
+  FeaturePointer feat = makeFeaturePointer();
+  if (gm.feat[pos] == nullptr) return feat; // not extracted yet.
+  for (MetaFeature f : this->feat) {
+    if (feat_slot[f] >= 0) insertFeature(feat, feat_name.at(f), gm.metaRow(pos)[feat_slot[f]]);
+  }
+  if (gm.discord_stride > 0) {
+    const double* discord = gm.discordRow(pos);
+    int yourval = gm.getLabel(pos);
+    for (size_t val = 0; val < gm.discord_stride; val++) {
+      if (discord[val] != 0) insertFeature(feat, make_nb(yourval, val), discord[val]);
+    }
+  }
+  insertFeature(feat, gm.feat[pos]);
   return feat;
 }
 
+// labels of an nb-discord key "c-<label>-<neighbour label>", false for other keys.
+static bool parseDiscordKey(const string& key, size_t& yourval, size_t& val) {
+  if (key.compare(0, 2, "c-") != 0) return false;
+  char* end;
+  yourval = strtoul(key.c_str() + 2, &end, 10);
+  if (*end != '-') return false;
+  val = strtoul(end + 1, &end, 10);
+  return *end == '\0';
+}
+
+void Policy::syncWeights(ParamPointer changed) {
+  for (MetaFeature f : this->feat) {
+    if (feat_slot[f] >= 0) weight[feat_slot[f]] = getParam(param, feat_name.at(f));
+  }
+  if (std::find(this->feat.begin(), this->feat.end(), FEAT_NB_DISCORD) == this->feat.end()) return;
+  ParamPointer keys = changed == nullptr ? param : changed;
+  size_t yourval, val, labels = discord_labels;
+  for (const ParamItem& p : *keys) {
+    if (parseDiscordKey(p.first, yourval, val)) labels = max(labels, max(yourval, val) + 1);
+  }
+  if (labels > discord_labels) { // a new label: lay the table out again, from all of param.
+    discord_labels = labels;
+    discord_weight.assign(labels * labels, 0);
+    keys = param;
+  }
+  for (const ParamItem& p : *keys) {
+    if (parseDiscordKey(p.first, yourval, val)) {
+      discord_weight[yourval * discord_labels + val] = getParam(param, p.first);
+    }
+  }
+}
+
 
 MarkovTreeNodePtr Policy::sampleOne(MarkovTreeNodePtr node, objcokus& rng, int pos) {
-  model->sampleOne(*node->gm, rng, pos);
+  int oldval = node->gm->getLabel(pos);
+  model->sampleOne(*node->gm, rng, pos, true, this->greedy(node, pos));
+  return this->commitSample(node, pos, oldval);
+}
+
+
+MarkovTreeNodePtr Policy::commitSample(MarkovTreeNodePtr node, int pos, int oldval) {
+  node->gm->time++;
+  if (converge or learn_stop) {
+    if (node->gm->getLabel(pos) != oldval) node->sweep_changes++;
+    node->sweep_ent_change += fabs(node->gm->entropy[pos] - node->gm->prev_entropy[pos]);
+  }
   node->log_prior_weight += node->gm->reward[pos];
 
-  if (node->log_prior_weight > node->max_log_prior_weight) {
-    node->max_log_prior_weight = node->log_prior_weight;
-    node->max_gm = model->copySample(*node->gm);
+  if (model->decoding == Model::DECODE_MAX and lean) { // log the steps away from the best sample.
+    if (node->log_prior_weight > node->max_log_prior_weight) {
+      node->max_log_prior_weight = node->log_prior_weight;
+      node->max_stale = true;
+      node->max_undo.clear();
+    } else if (node->max_stale) {
+      node->max_undo.push_back(std::make_pair(pos, oldval));
+    }
+  } else if (model->decoding == Model::DECODE_MAX) {
+    if (node->log_prior_weight > node->max_log_prior_weight) {
+      node->max_log_prior_weight = node->log_prior_weight;
+      node->max_gm = model->copySample(*node->gm);
+    }
+  } else {
+    node->gm->accumulateMarginal(pos, node->gm->this_sc[pos]);
   }
 
   node->gm->mask[pos] += 1;
@@ -528,11 +857,119 @@ MarkovTreeNodePtr Policy::sampleOne(MarkovTreeNodePtr node, objcokus& rng, int p
 }
 
 
+FeaturePointer Policy::extractStopFeatures(MarkovTreeNodePtr node) {
+  const GraphicalModel& gm = *node->gm;
+  size_t seqlen = gm.size();
+  double ent = 0;
+  for (size_t pos = 0; pos < seqlen; pos++) ent += gm.entropy[pos];
+  FeaturePointer feat = makeFeaturePointer();
+  insertFeature(feat, "stop-b");
+  insertFeature(feat, "stop-ent", ent / max((size_t)1, seqlen));
+  insertFeature(feat, "stop-change", node->sweep_changes / (double)max((size_t)1, seqlen));
+  insertFeature(feat, "stop-len", log(1 + seqlen));
+  return feat;
+}
+
+bool Policy::learnedStop(MarkovTreeNodePtr node) {
+  node->stop_feat = this->extractStopFeatures(node);
+  node->resp = logisticFunc(HeteroSampler::score(param, node->stop_feat));
+  node->compute_stop = true;
+  if (node->stop_trace != nullptr) {
+    node->stop_trace->feat.push_back(node->stop_feat);
+    node->stop_trace->score.push_back(this->evalSample(*this->decode(node)));
+    return false;
+  }
+  return node->resp > 0.5;
+}
+
+void Policy::trainStop(const StopTrace& trace) {
+  double best = -DBL_MAX;
+  for (size_t s = trace.feat.size(); s-- > 0; ) {
+    best = max(best, trace.score[s]);  // best score of this sweep and the later ones.
+    double resp = logisticFunc(HeteroSampler::score(param, trace.feat[s]));
+    ParamPointer grad = makeParamPointer();
+    if (trace.score[s] >= best) {
+      mapUpdate(*grad, *trace.feat[s], 1 - resp);
+    } else {
+      mapUpdate(*grad, *trace.feat[s], -resp);
+    }
+    adagrad(param, G2, grad, eta);
+  }
+}
+
+double Policy::evalSample(const GraphicalModel& gm) {
+  if (model->scoring == Model::SCORING_ACCURACY) {
+    return get<0>(model->evalPOS(dynamic_cast<const Tag&>(gm)));
+  } else if (model->scoring == Model::SCORING_NER) {
+    const Tag& tag = dynamic_cast<const Tag&>(gm);
+    ptr<Model::EvalTable> table;
+    {
+      std::lock_guard<std::mutex> lock(stop_tables_mutex);
+      ptr<Model::EvalTable>& entry = stop_tables[tag.seq];
+      if (entry == nullptr) entry = model->makeEvalTable(*tag.seq, true);
+      table = entry;
+    }
+    tuple<int, int, int> hit_pred_truth = model->evalLabels(*table, tag.tag);
+    // minus the number of false positives and false negatives.
+    return 2 * get<0>(hit_pred_truth) - get<1>(hit_pred_truth) - get<2>(hit_pred_truth);
+  }
+  return model->score(gm);
+}
+
+ptr<GraphicalModel> Policy::decode(MarkovTreeNodePtr node) {
+  if (model->decoding == Model::DECODE_MAX) {
+    if (node->max_stale) {
+      node->max_gm = model->copySample(*node->gm);
+      for (auto it = node->max_undo.rbegin(); it != node->max_undo.rend(); ++it) {
+        node->max_gm->setLabel(it->first, it->second);
+      }
+      node->max_undo.clear();
+      node->max_stale = false;
+    }
+    return node->max_gm ? node->max_gm : node->gm; // no sample yet, e.g. under a deadline.
+  }
+  ptr<GraphicalModel> gm = model->copySample(*node->gm);
+  model->decodeMarginal(*gm);
+  return gm;
+}
+
+
+tuple<double, double, double> Policy::evaluate(Policy::ResultPtr result, size_t i, MarkovTreeNodePtr node) {
+  if (result->eval_count.size() != result->size()) {
+    result->eval_table.resize(result->size());
+    result->eval_node.resize(result->size());
+    result->eval_restarts.resize(result->size());
+    result->eval_depth.resize(result->size());
+    result->eval_count.resize(result->size());
+  }
+  // every sample moves depth and every new run of the chain moves restarts, so a node at the same
+  // (restarts, depth) decodes to the same labels, also under marginal decodings, which are rebuilt per call.
+  if (result->eval_node[i].lock() == node and result->eval_restarts[i] == node->restarts and
+      result->eval_depth[i] == node->depth) return result->eval_count[i];
+  ptr<GraphicalModel> decoded = this->decode(node);
+  tuple<double, double, double> count;
+  if (model->scoring == Model::SCORING_LHOOD) {
+    count = make_tuple(model->score(*decoded), 1, 0);
+  } else {
+    if (result->eval_table[i] == nullptr) {
+      result->eval_table[i] = model->makeEvalTable(*decoded->seq, model->scoring == Model::SCORING_NER);
+    }
+    tuple<int, int, int> hit_pred_truth = model->evalLabels(*result->eval_table[i], cast<Tag>(decoded)->tag);
+    count = make_tuple(get<0>(hit_pred_truth), get<1>(hit_pred_truth), get<2>(hit_pred_truth));
+  }
+  result->eval_node[i] = node;
+  result->eval_restarts[i] = node->restarts;
+  result->eval_depth[i] = node->depth;
+  result->eval_count[i] = count;
+  return count;
+}
+
 /* update resp has two parts: update features, compute new responses */
 void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* heap) {
+  if (lean) return;
   /* extract my meta-feature */
-  FeaturePointer feat = this->extractFeatures(node, pos);
-  node->gm->feat[pos] = feat;
+  this->extractFeatures(node, pos);
+  double* row = node->gm->metaRow(pos);
 
   /* update neighbor stats */
   node->gm->changed[pos].clear();
@@ -545,23 +982,24 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
   }
 
   /* update my response */
-  node->gm->resp[pos] = HeteroSampler::score(this->param, feat);
+  node->gm->resp[pos] = this->response(*node->gm, pos);
   int val = node->gm->getLabel(pos), oldval = node->gm->oldlabels[pos];
 
   set<int> visited;
 
+  /* heap entries are changed in place and re-ordered once, after all responses are updated */
+  vec<Heap::handle_type> dirty;
   auto updateRespByHandle = [&] (int id) {
-    if (heap == nullptr) return;
-    Value& val = *node->gm->handle[id];
-    val.resp = node->gm->resp[id];
-    heap->update(node->gm->handle[id]);
+    Heap::handle_type handle = node->gm->handle[id];
+    if (heap == nullptr or !heap->contains(handle)) return; // not in the heap, e.g. a halo.
+    (*heap)[handle].resp = this->priority(node, id);
+    dirty.push_back(handle);
   };
   updateRespByHandle(pos);
 
   auto computeOracle = [&] (int id) {
-    auto feat = findFeature(node->gm->feat[id], feat_name[FEAT_ORACLE]);
-    *feat = sampleDelayedReward(node, id, this->mode_oracle, this->rewardK);
-    node->gm->resp[id] = HeteroSampler::score(this->param, node->gm->feat[id]);
+    node->gm->metaRow(id)[feat_slot[FEAT_ORACLE]] = sampleDelayedReward(node, id, this->mode_oracle, this->rewardK);
+    node->gm->resp[id] = this->response(*node->gm, id);
     updateRespByHandle(id);
   };
 
@@ -570,7 +1008,7 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
     model->sampleOne(*node->gm, rng, id, false);
     *feat = logEntropy(&node->gm->sc[0], node->gm->numLabels(id));
     node->gm->setLabel(id, oldval);
-    node->gm->resp[id] = HeteroSampler::score(this->param, node->gm->feat[id]);
+    node->gm->resp[id] = this->response(*node->gm, id);
     updateRespByHandle(id);
   };
 
@@ -579,34 +1017,30 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
     model->sampleOne(*node->gm, rng, id, false);
     *feat = node->gm->this_sc[id][oldval] - node->gm->sc[oldval];
     node->gm->setLabel(id, oldval);
-    node->gm->resp[id] = HeteroSampler::score(this->param, node->gm->feat[id]);
+    node->gm->resp[id] = this->response(*node->gm, id);
     updateRespByHandle(id);
   };
   
-  auto make_nb_discord = [] (int val, int your_val) {
-    return "c-" + tostr(val) + "-" + tostr(your_val);
-  };
-  
   /* update my friends' response */
   for(MetaFeature f : this->feat) {
-    string name = this->feat_name[f];
+    int slot = feat_slot[f];
     switch(f) {
       case FEAT_NB_VARY:
         /* update the nodes in inv Markov blanket */
         for (auto id : model->invMarkovBlanket(*node->gm, pos)) {
           if (node->gm->blanket[id].size() > 0) {
             assert(node->gm->blanket[id].contains(pos));
-            double* feat_nb_vary = findFeature(node->gm->feat[id], name);
+            double* feat_nb_vary = node->gm->metaRow(id) + slot;
             if (node->gm->blanket[id][pos] != val and node->gm->changed[id][pos] == false) {
               node->gm->changed[id][pos] = true;
               (*feat_nb_vary)++;
-              node->gm->resp[id] += (*param)[name];
+              node->gm->resp[id] += weight[slot];
               updateRespByHandle(id);
             }
             if (node->gm->blanket[id][pos] == val and node->gm->changed[id][pos] == true) {
               node->gm->changed[id][pos] = false;
               (*feat_nb_vary)--;
-              node->gm->resp[id] -= (*param)[name];
+              node->gm->resp[id] -= weight[slot];
               updateRespByHandle(id);
             }
           }
@@ -615,22 +1049,17 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
       case FEAT_NB_DISCORD:
         for(auto id : model->invMarkovBlanket(*node->gm, pos)) {
           if(node->gm->blanket[id].size() > 0) {
-            double yourval = node->gm->getLabel(id);
+            int yourval = node->gm->getLabel(id);
+            double* discord = node->gm->discordRow(id);
             if(node->gm->vary[id][pos] > 1) { // more than the first time.
               // invalidate old feat.
-              double* oldfeat = findFeature(node->gm->feat[id], make_nb_discord(yourval, oldval));
-              assert(oldfeat != nullptr and *oldfeat != 0);
-              node->gm->resp[id] -= (*param)[make_nb_discord(yourval, oldval)];
-              (*oldfeat)--;
+              assert(discord[oldval] != 0);
+              node->gm->resp[id] -= discordWeight(yourval, oldval);
+              discord[oldval]--;
             }
             // insert new feat.
-            double* newfeat = findFeature(node->gm->feat[id], make_nb_discord(yourval, val));
-            if(newfeat == nullptr) {
-              insertFeature(node->gm->feat[id], make_nb_discord(yourval, val));
-            }else{
-              (*newfeat)++;
-            }
-            node->gm->resp[id] += (*param)[make_nb_discord(yourval, val)];
+            discord[val]++;
+            node->gm->resp[id] += discordWeight(yourval, val);
             updateRespByHandle(id);
           }
         }
@@ -638,11 +1067,11 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
       case FEAT_NB_ENT:
         for (auto id : model->invMarkovBlanket(*node->gm, pos)) {
           if (node->gm->blanket[id].size() > 0) {
-            double* feat_nb_ent = findFeature(node->gm->feat[id], name);
+            double* feat_nb_ent = node->gm->metaRow(id) + slot;
             double ent_diff = (node->gm->entropy[pos] - node->gm->prev_entropy[pos])
                               / (double)node->gm->blanket[id].size();;
             (*feat_nb_ent) += ent_diff;
-            node->gm->resp[id] += (*param)[name] * ent_diff;
+            node->gm->resp[id] += weight[slot] * ent_diff;
           }
         }
         break;
@@ -657,18 +1086,18 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
         }    
         break;
       case FEAT_ORACLE_ENT:
-        computeOracleEnt(findFeature(feat, name), pos);
+        computeOracleEnt(row + slot, pos);
         for (auto id : model->invMarkovBlanket(*node->gm, pos)) {
           if (node->gm->blanket[id].size() > 0) { // has already been initialized.
-            computeOracleEnt(findFeature(node->gm->feat[id], name), id);
+            computeOracleEnt(node->gm->metaRow(id) + slot, id);
           }
         }
         break;
       case FEAT_ORACLE_STALENESS:
-        computeStaleness(findFeature(feat, name), pos);
+        computeStaleness(row + slot, pos);
         for (auto id : model->invMarkovBlanket(*node->gm, pos)) {
           if (node->gm->blanket[id].size() > 0) { // has already been initialized.
-            computeStaleness(findFeature(node->gm->feat[id], name), id);
+            computeStaleness(node->gm->metaRow(id) + slot, id);
           }
         }
         break;
@@ -677,6 +1106,8 @@ void Policy::updateResp(MarkovTreeNodePtr node, objcokus& rng, int pos, Heap* he
     }
   }
 
+  if (heap != nullptr) heap->update_many(dirty.begin(), dirty.end());
+
   /* update Markov blanket */
   node->gm->blanket[pos] = node->gm->getLabels(model->markovBlanket(*node->gm, pos));
 }
@@ -692,7 +1123,7 @@ void Policy::logNode(MarkovTreeNodePtr node) {
     *lg << " / [" << boost::lexical_cast<string>(index) + "]";
   };
 
-  for (size_t i = 0; i < node->gm->size(); i++) {
+  for (size_t i = 0; i < node->gm->size() and !lean; i++) { // lean sampling keeps no responses.
     *lg << node->gm->resp[i];
     if (verbose) {
       logIndex(i);
@@ -705,9 +1136,10 @@ void Policy::logNode(MarkovTreeNodePtr node) {
     lg->begin("feat");
     /* take the uninon of features from all positions */
     std::set<string> feat_names;
+    vec<FeaturePointer> feats;
     for (size_t t = 0; t < node->gm->size(); t++) {
-      if (node->gm->feat[t] == nullptr) continue;
-      for (auto& p : *node->gm->feat[t]) {
+      feats.push_back(this->featureList(*node->gm, t));
+      for (auto& p : *feats.back()) {
         feat_names.insert(string(p.first));
       }
     }
@@ -715,7 +1147,7 @@ void Policy::logNode(MarkovTreeNodePtr node) {
     for (auto& p : feat_names) {
       lg->begin(p);
       for (size_t i = 0; i < node->gm->size(); i++) {
-        *lg << getFeature(node->gm->feat[i], p);
+        *lg << getFeature(feats[i], p);
         if (verbose) {
           logIndex(i);
         }
@@ -748,11 +1180,299 @@ void Policy::resetLog(std::shared_ptr<XMLlog> new_lg) {
 
 /////////////////////////// Gibbs Policy ///////////////////////////////
 GibbsPolicy::GibbsPolicy(ModelPtr model, const po::variables_map& vm)
-  : Policy(model, vm), T(vm["T"].as<size_t>())
+  : Policy(model, vm), T(vm["T"].as<size_t>()),
+    sweep(vm["sweep"].empty() ? "sequential" : vm["sweep"].as<string>()),
+    tile(vm["tile"].empty() ? 32 : vm["tile"].as<int>()),
+    sweep_pool(nullptr)
 {
+  if (sweep == "chromatic" or sweep == "hogwild" or sweep == "tiled") {
+    if (interleave > 1) throw "interleaved chains require sequential sweeps.";
+    if (!vm["temp"].empty() and vm["temp"].as<string>() != "")
+      throw "parallel sweeps do not support annealing.";
+    sweep_pool = makeJobPool(vm["numThreads"].as<size_t>());
+  } else if (sweep != "sequential") {
+    throw "unrecognized sweep mode.";
+  }
+  // gibbs sweeps read no responses, so without meta-features there is nothing to maintain.
+  lean = feat.size() == 0 and lets_inplace;
+}
+
+void GibbsPolicy::sample(int tid, MarkovTreeNodePtr node) {
+  if (sweep_pool == nullptr) {
+    Policy::sample(tid, node);
+    return;
+  }
+  node->depth = 0;
+  node->restarts++;
+  objcokus& rng = test_thread_pool.rngs[tid];
+  node->gm->rng = &rng;
+  try {
+    size_t seqlen = node->gm->size();
+    if (sweep == "chromatic" and node->gm->colors.size() == 0) {
+      node->gm->colors = model->colorGraph(*node->gm);
+    }
+    this->sampleInit(node, rng);
+    while (node->stop_sweep < 0 and node->depth < T * seqlen) {
+      if ((converge or learn_stop) and node->depth > 0 and this->endSweep(node)) break;
+      if (sweep == "chromatic") {
+        this->sampleChromatic(node, rng);
+      } else if (sweep == "tiled") {
+        this->sampleTiled(node, rng);
+      } else { // without convergence checks, run all sweeps without a barrier.
+        this->sampleHogwild(node, rng, converge or learn_stop ? 1 : (T * seqlen - node->depth) / seqlen);
+      }
+    }
+    node->job_replicas.clear(); // rebuilt by the next run.
+    node->log_weight = model->score(*node->gm);
+    node->gradient = makeParamPointer();
+  } catch (const char* ee) {
+    cout << "error: " << ee << endl;
+  }
+}
+
+vec<objcokus>& GibbsPolicy::jobRngs(MarkovTreeNodePtr node, objcokus& rng) {
+  if (node->job_rngs.size() != sweep_pool->numThreads()) {
+    // seeded in place: objcokus points into its own state, so it must not be copied once seeded.
+    node->job_rngs = vec<objcokus>(sweep_pool->numThreads());
+    for (objcokus& job_rng : node->job_rngs) job_rng.seedMT(rng.randomMT());
+  }
+  return node->job_rngs;
+}
+
+void GibbsPolicy::sampleChromatic(MarkovTreeNodePtr node, objcokus& rng) {
+  GraphicalModel& gm = *node->gm;
+  vec<int> oldval(gm.size());
+  vec<objcokus>& job_rngs = this->jobRngs(node, rng);
+  for (const vec<int>& color : gm.colors) {
+    size_t num_jobs = min(sweep_pool->numThreads(), color.size());
+    parallel_for(*sweep_pool, 0, num_jobs, [&] (int tid, size_t j) {
+      objcokus& job_rng = job_rngs[j]; // one stream per job of this chain, independent of scheduling.
+      for (size_t i = j; i < color.size(); i += num_jobs) {
+        int pos = color[i];
+        oldval[pos] = gm.getLabel(pos);
+        model->sampleOne(gm, job_rng, pos, true, this->greedy(node, pos));
+      }
+    });
+    for (int pos : color) {
+      this->commitSample(node, pos, oldval[pos]);
+      this->updateResp(node, rng, pos, nullptr);
+    }
+  }
+}
+
+void GibbsPolicy::sampleHogwild(MarkovTreeNodePtr node, objcokus& rng, size_t sweeps) {
+  GraphicalModel& gm = *node->gm;
+  size_t seqlen = gm.size(), num_jobs = min(sweep_pool->numThreads(), seqlen);
+  if (sweeps == 0) sweeps = 1;
+  if (model->decoding != Model::DECODE_MAX and gm.marginal.size() != seqlen) {
+    gm.marginal.resize(seqlen);
+  }
+
+  /* labels are shared through atomics. each job samples its own shard
+   * of positions on a replica whose blanket is refreshed before each step. */
+  std::vector<std::atomic<int> > labels(seqlen);
+  for (size_t pos = 0; pos < seqlen; pos++) {
+    labels[pos].store(gm.getLabel(pos), std::memory_order_relaxed);
+  }
+  vec<objcokus>& job_rngs = this->jobRngs(node, rng);
+  /* replicas are copied once per run of the chain. a job only samples its own shard, whose
+   * stats it keeps, so later calls only need the labels of the other shards. */
+  vec<ptr<GraphicalModel> >& replicas = node->job_replicas;
+  bool fresh = node->depth == 0 or replicas.size() != num_jobs;
+  if (fresh) {
+    replicas.resize(num_jobs);
+    for (size_t j = 0; j < num_jobs; j++) {
+      replicas[j] = model->copySample(gm);
+    }
+  }
+  vec<double> ent_change(num_jobs, 0);
+  vec<size_t> changes(num_jobs, 0), stale(num_jobs, 0), reads(num_jobs, 0);
+  auto shardBegin = [&] (size_t j) { return j * seqlen / num_jobs; };
+  parallel_for(*sweep_pool, 0, num_jobs, [&] (int tid, size_t j) {
+    GraphicalModel& replica = *replicas[j];
+    objcokus& job_rng = job_rngs[j];
+    if (!fresh) {
+      for (size_t pos = 0; pos < seqlen; pos++) {
+        int val = labels[pos].load(std::memory_order_relaxed);
+        if (replica.getLabel(pos) != val) replica.setLabel(pos, val);
+      }
+    }
+    vec<int> order;
+    for (size_t pos = shardBegin(j); pos < shardBegin(j + 1); pos++) {
+      order.push_back(pos);
+    }
+    vec<int> seen;
+    for (size_t t = 0; t < sweeps; t++) {
+      for (size_t i = order.size(); i > 1; i--) { // random scan of the shard.
+        std::swap(order[i - 1], order[job_rng.randomMT() % i]);
+      }
+      for (int pos : order) {
+        vec<int> blanket = model->markovBlanket(replica, pos);
+        seen.resize(blanket.size());
+        for (size_t b = 0; b < blanket.size(); b++) {
+          seen[b] = labels[blanket[b]].load(std::memory_order_relaxed);
+          if (replica.getLabel(blanket[b]) != seen[b]) {
+            replica.setLabel(blanket[b], seen[b]);
+          }
+        }
+        int oldval = replica.getLabel(pos);
+        model->sampleOne(replica, job_rng, pos, true, this->greedy(node, pos));
+        int val = replica.getLabel(pos);
+        labels[pos].store(val, std::memory_order_relaxed);
+
+        if (val != oldval) changes[j]++;
+        ent_change[j] += fabs(replica.entropy[pos] - replica.prev_entropy[pos]);
+        if (model->decoding != Model::DECODE_MAX) {
+          gm.accumulateMarginal(pos, replica.this_sc[pos]);
+        }
+        gm.mask[pos] += 1;
+        for (size_t b = 0; b < blanket.size(); b++) {
+          if (labels[blanket[b]].load(std::memory_order_relaxed) != seen[b]) stale[j]++;
+        }
+        reads[j] += blanket.size();
+      }
+    }
+  });
+
+  /* merge replicas back into the node */
+  for (size_t j = 0; j < num_jobs; j++) {
+    for (size_t pos = shardBegin(j); pos < shardBegin(j + 1); pos++) {
+      gm.setLabel(pos, labels[pos].load(std::memory_order_relaxed));
+      gm.copyStats(*replicas[j], pos);
+    }
+    node->sweep_changes += changes[j];
+    node->sweep_ent_change += ent_change[j];
+    node->stale_reads += stale[j];
+    node->blanket_reads += reads[j];
+  }
+  gm.time += sweeps * seqlen;
+  node->depth += sweeps * seqlen;
+  node->log_prior_weight = model->score(gm); // rewards under stale blankets do not add up.
+  if (model->decoding == Model::DECODE_MAX and node->log_prior_weight > node->max_log_prior_weight) {
+    node->max_log_prior_weight = node->log_prior_weight;
+    node->max_gm = model->copySample(gm);
+  }
+  for (size_t pos = 0; pos < seqlen; pos++) {
+    this->updateResp(node, rng, pos, nullptr);
+  }
+}
+
+void GibbsPolicy::makeTiles(MarkovTreeNodePtr node, objcokus& rng) {
+  auto tag = std::dynamic_pointer_cast<Tag>(node->gm);
+  const ImageIsing* image = tag == nullptr ? nullptr : dynamic_cast<const ImageIsing*>(tag->seq);
+  if (image == nullptr) throw "tiled sweeps require ising images.";
+  if (tile <= 0) throw "tile size must be positive.";
+  node->tiles.clear();
+  for (int w0 = 0; w0 < image->W; w0 += tile) {
+    for (int h0 = 0; h0 < image->H; h0 += tile) {
+      int h1 = min(h0 + tile, image->H), w1 = min(w0 + tile, image->W);
+      int ch0 = max(h0 - 1, 0), cw0 = max(w0 - 1, 0);  // crop = tile + halo.
+      int ch1 = min(h1 + 1, image->H), cw1 = min(w1 + 1, image->W);
+      auto crop = image->crop(ch0, cw0, ch1, cw1);
+      auto t = std::make_shared<Tile>();
+      t->instance = crop;
+      t->budget = 0;
+      t->rng.seedMT(rng.randomMT());
+      t->node = makeMarkovTreeNode(nullptr);
+      t->node->model = model;
+      t->node->gm = model->makeSample(*crop, model->corpus, &t->rng);
+      t->node->max_log_prior_weight = DBL_MAX; // the best sample is tracked on the full image.
+      GraphicalModel& tile_gm = *t->node->gm;
+      t->global.resize(crop->size());
+      for (int w = cw0; w < cw1; w++) {  // fortran style, so interiors are swept in memory order.
+        for (int h = ch0; h < ch1; h++) {
+          int pos = crop->ptToPos(ImageIsing::Pt(h - ch0, w - cw0)), id = image->ptToPos(ImageIsing::Pt(h, w));
+          t->global[pos] = id;
+          tile_gm.setLabel(pos, node->gm->getLabel(id));
+          tile_gm.copyStats(*node->gm, id, pos);
+          tile_gm.mask[pos] = node->gm->mask[id];
+          if (h >= h0 and h < h1 and w >= w0 and w < w1) {
+            t->interior.push_back(pos);
+          } else {
+            t->halo.push_back(pos);
+          }
+        }
+      }
+      node->tiles.push_back(t);
+    }
+  }
+}
+
+void GibbsPolicy::pullHalo(Tile& tile, const GraphicalModel& gm) {
+  GraphicalModel& tile_gm = *tile.node->gm;
+  for (int pos : tile.halo) {
+    int id = tile.global[pos], oldval = tile_gm.getLabel(pos);
+    if (gm.getLabel(id) == oldval) continue;
+    tile_gm.setLabel(pos, gm.getLabel(id));
+    tile_gm.copyStats(gm, id, pos);
+    tile_gm.oldlabels[pos] = oldval; // the neighbor change as seen by this tile.
+    this->updateResp(tile.node, tile.rng, pos, &tile.heap);
+  }
+}
+
+void GibbsPolicy::mergeTiles(MarkovTreeNodePtr node, size_t samples) {
+  GraphicalModel& gm = *node->gm;
+  if (model->decoding != Model::DECODE_MAX and gm.marginal.size() != gm.size()) {
+    gm.marginal.resize(gm.size());
+  }
+  for (auto t : node->tiles) {
+    GraphicalModel& tile_gm = *t->node->gm;
+    for (int pos : t->interior) {
+      int id = t->global[pos];
+      gm.setLabel(id, tile_gm.getLabel(pos));
+      gm.copyStats(tile_gm, pos, id);
+      gm.mask[id] = tile_gm.mask[pos];
+      gm.resp[id] = tile_gm.resp[pos];
+      gm.feat[id] = tile_gm.feat[pos];
+      if (tile_gm.meta_stride > 0) {
+        if (gm.meta_stride != tile_gm.meta_stride) {
+          gm.meta_stride = tile_gm.meta_stride;
+          gm.meta.assign(gm.size() * gm.meta_stride, 0);
+        }
+        std::copy(tile_gm.metaRow(pos), tile_gm.metaRow(pos) + gm.meta_stride, gm.metaRow(id));
+      }
+      if (tile_gm.discord_stride > 0) {
+        if (gm.discord_stride != tile_gm.discord_stride) {
+          gm.discord_stride = tile_gm.discord_stride;
+          gm.discord.assign(gm.size() * gm.discord_stride, 0);
+        }
+        std::copy(tile_gm.discordRow(pos), tile_gm.discordRow(pos) + gm.discord_stride, gm.discordRow(id));
+      }
+      if ((size_t)pos < tile_gm.marginal.size()) gm.marginal[id] = tile_gm.marginal[pos];
+    }
+    node->sweep_changes += t->node->sweep_changes;
+    node->sweep_ent_change += t->node->sweep_ent_change;
+    t->node->sweep_changes = 0;
+    t->node->sweep_ent_change = 0;
+  }
+  gm.time += samples;
+  node->depth += samples;
+  node->log_prior_weight = model->score(gm);
+  if (model->decoding == Model::DECODE_MAX and node->log_prior_weight > node->max_log_prior_weight) {
+    node->max_log_prior_weight = node->log_prior_weight;
+    node->max_gm = model->copySample(gm);
+  }
+}
+
+void GibbsPolicy::sampleTiled(MarkovTreeNodePtr node, objcokus& rng) {
+  if (node->tiles.size() == 0) this->makeTiles(node, rng);
+  parallel_for(*sweep_pool, 0, node->tiles.size(), [&] (int tid, size_t j) {
+    Tile& t = *node->tiles[j];
+    this->pullHalo(t, *node->gm);
+    for (int pos : t.interior) {
+      t.node = Policy::sampleOne(t.node, t.rng, pos);
+      this->updateResp(t.node, t.rng, pos, nullptr);
+    }
+  });
+  this->mergeTiles(node, node->gm->size());
 }
 
 Location GibbsPolicy::policy(MarkovTreeNodePtr node) {
+  if (node->stop_sweep >= 0) return Location(); // converged.
+  if ((converge or learn_stop) and node->depth > 0 and node->depth % node->gm->size() == 0
+      and this->endSweep(node)) {
+    return Location();
+  }
   if (node->depth == 0) node->time_stamp = 0;
   if (node->depth < T * node->gm->size()) {
     node->time_stamp++;
@@ -762,10 +1482,81 @@ Location GibbsPolicy::policy(MarkovTreeNodePtr node) {
   return Location(); // stop.
 }
 
+bool GibbsPolicy::converged(MarkovTreeNodePtr node) {
+  size_t seqlen = node->gm->size();
+  double change = node->sweep_changes / (double)seqlen;
+  double ent_change = node->sweep_ent_change / (double)seqlen;
+  node->sweep++;
+  node->sweep_changes = 0;
+  node->sweep_ent_change = 0;
+
+  double rhat = 1;
+  if (node->diag != nullptr) {
+    auto diag = node->diag;
+    objcokus& rng = *node->gm->rng;
+    if (diag->lockstep != nullptr) {
+      diag->lockstep->sweep(rng);
+      diag->aux_log_weight = diag->lockstep->log_weight;
+    }
+    for (size_t k = 0; k < diag->aux.size(); k++) { // advance auxiliary chains by one sweep.
+      for (size_t pos = 0; pos < diag->aux[k]->size(); pos++) {
+        model->sampleOne(*diag->aux[k], rng, pos, false);
+        diag->aux_log_weight[k] += diag->aux[k]->reward[pos];
+      }
+    }
+    if (node->sweep >= 2) { // discard the first sweep as burn-in.
+      diag->add(0, node->log_prior_weight);
+      for (size_t k = 0; k < diag->aux_log_weight.size(); k++) {
+        diag->add(k + 1, diag->aux_log_weight[k]);
+      }
+    }
+    rhat = diag->rhat();
+  }
+  return node->sweep >= 2 and change <= converge_change
+         and ent_change <= converge_ent and rhat <= converge_rhat;
+}
+
+bool GibbsPolicy::endSweep(MarkovTreeNodePtr node) {
+  bool stop = learn_stop and this->learnedStop(node); // reads the sweep counters, converged resets them.
+  if (converge) {
+    stop = this->converged(node) or stop;
+  } else {
+    node->sweep++;
+    node->sweep_changes = 0;
+    node->sweep_ent_change = 0;
+  }
+  if (stop) node->stop_sweep = node->sweep;
+  return stop;
+}
+
 /////////////////////////// Block Policy ///////////////////////////////
 BlockPolicy::BlockPolicy(ModelPtr model, const variables_map& vm)
-  : GibbsPolicy(model, vm) {
-
+  : GibbsPolicy(model, vm),
+    multiqueue(vm["multiqueue"].empty() ? 0 : vm["multiqueue"].as<size_t>()),
+    cost_aware(vm["cost_aware"].empty() ? false : vm["cost_aware"].as<bool>()),
+    freeze(vm["freeze"].empty() ? 0 : vm["freeze"].as<size_t>()),
+    deadline(vm["deadline"].empty() ? 0 : vm["deadline"].as<double>()),
+    deadline_scope(vm["deadline_scope"].empty() ? "corpus" : vm["deadline_scope"].as<string>()) {
+  if (multiqueue > 0) {
+    if (sweep == "tiled") throw "multiqueue does not apply to tiled sweeps.";
+    if (sweep_pool == nullptr) sweep_pool = makeJobPool(vm["numThreads"].as<size_t>());
+  }
+  if (cost_aware and (multiqueue > 0 or sweep == "tiled")) {
+    throw "cost_aware scheduling needs the global heap.";
+  }
+  if (freeze > 0 and (multiqueue > 0 or sweep == "tiled")) {
+    throw "freeze needs the global heap.";
+  }
+  if (deadline > 0 and (multiqueue > 0 or sweep == "tiled")) {
+    throw "deadline needs the global heap.";
+  }
+  if (deadline_scope != "corpus" and deadline_scope != "sentence") {
+    throw "unrecognized deadline_scope.";
+  }
+  if (learn_stop) {
+    throw "learn_stop is for the gibbs policy.";
+  }
+  lean = false; // the heap is ordered by responses.
 }
 
 
@@ -789,6 +1580,12 @@ ptr<BlockPolicy::Result> BlockPolicy::test(ptr<Corpus> corpus, double budget) {
   auto result = std::make_shared<BlockPolicy::Result>(corpus);
   result->corpus->retag(model->corpus);
   result->nodes.resize(fmin((size_t)test_count, (size_t)corpus->seqs.size()), nullptr);
+  if (multiqueue > 0) {
+    size_t num_shards = max((size_t)1, min(multiqueue * sweep_pool->numThreads(), result->size()));
+    for (size_t k = 0; k < num_shards; k++) {
+      result->shards.push_back(std::make_shared<Result::Shard>());
+    }
+  }
 
   for (size_t i = 0; i < result->size(); i++) {
     auto node = makeMarkovTreeNode(nullptr);
@@ -796,15 +1593,18 @@ ptr<BlockPolicy::Result> BlockPolicy::test(ptr<Corpus> corpus, double budget) {
     node->gm = model->makeSample(*corpus->seqs[i], model->corpus, &rng);
     node->log_prior_weight = model->score(*node->gm);
     result->nodes[i] = node;
+    if (sweep == "tiled") continue; // heaps are per tile, see sampleTiled.
+    Heap& heap = multiqueue > 0 ? result->shards[i % result->shards.size()]->heap : result->heap;
     for (int t = 0; t < node->gm->size(); t++) {
       node->gm->resp[t] = 1e8 - t; // this is a hack.
-      Heap::handle_type handle = result->heap.push(Value(Location(i, t), node->gm->resp[t]));
+      Heap::handle_type handle = heap.push(Value(Location(i, t), node->gm->resp[t]));
       node->gm->handle[t] = handle;
     }
   }
 
   result->time = 0;
   result->wallclock = 0;
+  result->cputime = 0;
   test(result, budget);
   return result;
 }
@@ -832,11 +1632,47 @@ void BlockPolicy::test(BlockPolicy::ResultPtr result, double budget) {
 
 void BlockPolicy::test_policy(ptr<BlockPolicy::Result> result, double budget) {
   clock_t time_start = clock(), time_end;
+  auto wall_start = std::chrono::steady_clock::now();
   assert(result != nullptr);
-  double total_budget = result->corpus->count(test_count) * budget;
-  for (size_t b = 0; b < total_budget; b++) {
-    auto p = policy(result);
-    result->setNode(p.index, this->sampleOne(result, this->rng, p));
+  this->syncWeights();
+  double total_budget = result->corpus->count(test_count) * budget, samples = total_budget;
+  double seconds = 0;
+  if (sweep == "tiled") {
+    this->sampleTiled(result, budget);
+  } else if (multiqueue > 0) {
+    this->sampleMultiQueue(result, (size_t)ceil(total_budget));
+  } else if (deadline > 0) {
+    double limit = budget * deadline * (deadline_scope == "sentence" ? result->size() : 1);
+    samples = this->sampleUntil(result, wall_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                          std::chrono::duration<double>(limit)),
+                                deadline_scope == "sentence" ? budget * deadline : 0);
+  } else if (cost_aware) {
+    /* the budget in samples is converted at the mean cost measured so far,
+     * each step is charged the estimated cost of the chosen position.
+     * until enough kernels were measured, steps calibrate the cost model and are charged the mean. */
+    samples = 0;
+    while (costs.count() < COST_CALIBRATION_STEPS and samples < total_budget and !result->heap.empty()) {
+      auto p = policy(result);
+      result->setNode(p.index, this->sampleOne(result, this->rng, p));
+      samples++;
+    }
+    double seconds_budget = total_budget * costs.mean();
+    seconds = samples * costs.mean();
+    while (seconds < seconds_budget and !result->heap.empty()) {
+      auto p = policy(result);
+      seconds += this->cost(result->getNode(p.index), p.pos);
+      result->setNode(p.index, this->sampleOne(result, this->rng, p));
+      samples++;
+    }
+  } else {
+    for (size_t b = 0; b < total_budget; b++) {
+      if (result->heap.empty()) { // every position is frozen.
+        samples = b;
+        break;
+      }
+      auto p = policy(result);
+      result->setNode(p.index, this->sampleOne(result, this->rng, p));
+    }
   }
   double hit_count = 0, pred_count = 0, truth_count = 0;
   this->lg->begin("example");
@@ -845,19 +1681,10 @@ void BlockPolicy::test_policy(ptr<BlockPolicy::Result> result, double budget) {
     lg->begin("example_" + std::to_string(i));
     this->logNode(node);
     while (node->children.size() > 0) node = node->children[0]; // take final sample.
-    if (this->model->scoring == Model::SCORING_ACCURACY) {
-      tuple<int, int> hit_pred = this->model->evalPOS(*cast<Tag>(node->max_gm));
-      hit_count += std::get<0>(hit_pred);
-      pred_count += std::get<1>(hit_pred);
-    } else if (this->model->scoring == Model::SCORING_NER) {
-      tuple<int, int, int> hit_pred_truth = this->model->evalNER(*cast<Tag>(node->max_gm));
-      hit_count += std::get<0>(hit_pred_truth);
-      pred_count += std::get<1>(hit_pred_truth);
-      truth_count += std::get<2>(hit_pred_truth);
-    } else if (this->model->scoring == Model::SCORING_LHOOD) {
-      hit_count += this->model->score(*node->max_gm);
-      pred_count++;
-    }
+    tuple<double, double, double> hit_pred_truth = this->evaluate(result, i, node);
+    hit_count += std::get<0>(hit_pred_truth);
+    pred_count += std::get<1>(hit_pred_truth);
+    truth_count += std::get<2>(hit_pred_truth);
     lg->end(); // </example_i>
   }
   lg->end(); // </example>
@@ -866,8 +1693,12 @@ void BlockPolicy::test_policy(ptr<BlockPolicy::Result> result, double budget) {
   time_end = clock();
   double accuracy = (double)hit_count / pred_count;
   double recall = (double)hit_count / truth_count;
-  result->time += total_budget / result->size();
-  result->wallclock += (double)(time_end - time_start) / CLOCKS_PER_SEC;
+  result->hit_count = hit_count;
+  result->pred_count = pred_count;
+  result->truth_count = truth_count;
+  result->time += samples / result->size();
+  result->cputime += (double)(time_end - time_start) / CLOCKS_PER_SEC;
+  result->wallclock += std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
   lg->begin("time");
   *auxlg << "time: " << result->time << std::endl;
   *lg << result->time << std::endl;
@@ -876,6 +1707,9 @@ void BlockPolicy::test_policy(ptr<BlockPolicy::Result> result, double budget) {
   *auxlg << "wallclock: " << result->wallclock << std::endl;
   *lg << result->wallclock << std::endl;
   lg->end(); // </wallclock>
+  lg->begin("cputime");
+  *lg << result->cputime << std::endl;
+  lg->end(); // </cputime>
   lg->begin("wallclock_sample");
   *auxlg << "wallclock_sample: " << result->wallclock_sample << std::endl;
   *lg << result->wallclock_sample << std::endl;
@@ -884,6 +1718,17 @@ void BlockPolicy::test_policy(ptr<BlockPolicy::Result> result, double budget) {
   *auxlg << "wallclock_policy: " << result->wallclock_policy << std::endl;
   *lg << result->wallclock_policy << std::endl;
   lg->end();
+  if (freeze > 0) {
+    lg->begin("frozen");
+    *auxlg << "frozen: " << result->heap.erased() << std::endl;
+    *lg << result->heap.erased() << std::endl;
+    lg->end();
+  }
+  if (seconds > 0) {
+    lg->begin("cost_seconds");
+    *lg << seconds << std::endl;
+    lg->end();
+  }
   if (this->model->scoring == Model::SCORING_ACCURACY) {
     lg->begin("accuracy");
     *lg << accuracy << std::endl;
@@ -914,32 +1759,34 @@ void BlockPolicy::test_policy(Policy::ResultPtr result) {
 
 void BlockPolicy::sample(int tid, MarkovTreeNodePtr node) {
   node->depth = 0;
+  node->restarts++;
   node->choice = -1;
   try{
     objcokus& rng = thread_pool.rngs[tid];
     node->gm->rng = &rng; 
     for(size_t i = 0; i < node->gm->size(); i++) {
       this->sampleOne(node, rng, i);
-      thread_pool.lock();
+      if(sync_every == 0) thread_pool.lock();  // otherwise param only changes between batches.
       this->updateResp(node, rng, i, nullptr);
-      thread_pool.unlock();
+      if(sync_every == 0) thread_pool.unlock();
       if(verbose) {
+        thread_pool.lock();  // lg is shared by all workers.
         lg->begin("T_0_i_" + to_string(i));
         logNode(node);
         lg->end();
+        thread_pool.unlock();
       }
     }
     for(size_t t = 1; t < T; t++) {
       for(size_t i = 0; i < node->gm->size(); i++) {
         node->time_stamp = t * node->gm->size() + i;
         /* extract features */
-        FeaturePointer feat = node->gm->feat[i];
+        FeaturePointer feat = this->featureList(*node->gm, i);
 
         // double resp = node->gm->resp[i];
         double log_resp = HeteroSampler::score(param, feat); // fix: param always changes, so does resp.
         double logR = 0;
         double staleness = 0;
-        PolicyExample example;
         
         /* estimate reward */
 #if REWARD_SCHEME == REWARD_ACCURACY
@@ -960,11 +1807,7 @@ void BlockPolicy::sample(int tid, MarkovTreeNodePtr node) {
 
 #elif REWARD_SCHEME == REWARD_LHOOD
         logR = sampleDelayedReward(node, i, this->mode_reward, this->rewardK);
-        
-        if(lets_resp_reward) {  // record training examples.
-        // if(logR > 5) {  // record high-reward examples.
-          example.oldstr = node->gm->str();
-        }
+        int oldval = node->gm->getLabel(i);
         
         this->sampleOne(node, rng, i);
         // int oldval = node->gm->getLabel(i);
@@ -992,7 +1835,7 @@ void BlockPolicy::sample(int tid, MarkovTreeNodePtr node) {
 #endif
         /* use gradients to update model */
 
-        thread_pool.lock();
+        if(sync_every == 0) thread_pool.lock();
 
         auto grad = makeParamPointer();
         /* update meta-model (strategy 1) */
@@ -1023,47 +1866,38 @@ void BlockPolicy::sample(int tid, MarkovTreeNodePtr node) {
         /* update meta-model (strategy 3) neural network */
         if(learning == "nn") {
           double resp = logisticFunc(log_resp);
-          if(param->count("L2-w") == 0) {
-            (*param)["L2-w"] = 0;
-          }
-          if(param->count("L2-b") == 0) {
-            (*param)["L2-b"] = 0;
-          }
-          double w = (*param)["L2-w"];
-          double b = (*param)["L2-b"];
+          double w = getParam(param, "L2-w");
+          double b = getParam(param, "L2-b");
           double diff = (logR - w * resp - b);
           mapUpdate(*grad, *feat, diff * resp * (1 - resp) * w);
           mapUpdate(*grad, "L2-w", diff * resp);
           mapUpdate(*grad, "L2-b", diff);
         }
         
-        adagrad(param, G2, grad, eta);   // overwrite adagrad, for fine-grain gradients. (return node->gradient empty).
+        if(sync_every > 0) {  // merged by train_policy after the batch.
+          mapUpdate(*thread_grad[tid], *grad);
+        }else{
+          adagrad(param, G2, grad, eta);   // overwrite adagrad, for fine-grain gradients. (return node->gradient empty).
+          this->syncWeights(grad);
+          if(lets_resp_reward) recorder->commit(grad, param);
+        }
 
-        
-       if(lets_resp_reward) {  // record training examples.
-          example.reward = logR;
-          example.staleness = staleness;
-          example.resp = log_resp;
-          example.feat = makeFeaturePointer();
-          example.param = makeParamPointer();
-          example.node = node;
-          example.str = node->gm->str();
-          example.choice = i;
-          *example.feat = *feat;
-          *example.param = *param;
-          this->examples.push_back(example);
+        if(lets_resp_reward) {  // record training examples.
+          recorder->record(logR, log_resp, staleness, node->gm->seq, i, oldval, node->gm->getLabel(i), feat);
         }
         
         if(verbose) {
+          if(sync_every > 0) thread_pool.lock();  // lg is shared by all workers.
           lg->begin("T_" + to_string(t) + "_i_" + to_string(i));
           logNode(node);
           lg->end();
+          if(sync_every > 0) thread_pool.unlock();
         }
 
         /* update response */
         this->updateResp(node, rng, i, nullptr);
         
-        thread_pool.unlock();
+        if(sync_every == 0) thread_pool.unlock();
       }
     }
     node->log_weight = 0;
@@ -1075,30 +1909,253 @@ void BlockPolicy::sample(int tid, MarkovTreeNodePtr node) {
 MarkovTreeNodePtr BlockPolicy::sampleOne(ptr<BlockPolicy::Result> result,
     objcokus& rng,
     const Location& loc) {
-  clock_t clock_start = clock(), clock_end;
+  auto clock_start = std::chrono::steady_clock::now();  // real time, like Result::wallclock.
+  uint64_t cycles = readCycles();
   int index = loc.index, pos = loc.pos;
   MarkovTreeNodePtr node = result->getNode(index);
   node->gm->rng = &rng;
+  int oldval = node->gm->getLabel(pos);
+  bool blanket_stable = node->gm->blanket[pos].size() > 0;  // blanket as of the last visit.
+  for (const pair<int, int>& b : node->gm->blanket[pos]) {
+    blanket_stable = blanket_stable and node->gm->getLabel(b.first) == b.second;
+  }
   node = Policy::sampleOne(node, rng, pos);
-  clock_end = clock();
-  result->wallclock_sample += (double)(clock_end - clock_start) / CLOCKS_PER_SEC;
-  clock_start = clock();
+  auto clock_end = std::chrono::steady_clock::now();
+  result->wallclock_sample += std::chrono::duration<double>(clock_end - clock_start).count();
+  clock_start = clock_end;
   Policy::updateResp(node, rng, pos, &result->heap);
-  clock_end = clock();
-  result->wallclock_policy += (double)(clock_end - clock_start) / CLOCKS_PER_SEC;
+  clock_end = std::chrono::steady_clock::now();
+  result->wallclock_policy += std::chrono::duration<double>(clock_end - clock_start).count();
+  if (cost_aware) { // measure the kernel, then rank pos by its new estimate.
+    double seconds = (readCycles() - cycles) * secondsPerCycle();
+    costs.add(costs.classOf(node->gm->blanket[pos].size()), seconds);
+    node->gm->cost[pos] = costs.smooth(node->gm->cost[pos], seconds);
+    Heap::handle_type handle = node->gm->handle[pos];
+    if (result->heap.contains(handle)) {
+      result->heap[handle].resp = this->priority(node, pos);
+      result->heap.update(handle);
+    }
+  }
+  if (freeze > 0) this->freezeOrThaw(result, node, pos, oldval, blanket_stable);
   return node;
 }
 
+size_t BlockPolicy::sampleUntil(ptr<BlockPolicy::Result> result, std::chrono::steady_clock::time_point deadline,
+                                double sentence_seconds) {
+  size_t steps = 0;
+  vec<double> spent(sentence_seconds > 0 ? result->size() : 0, 0);
+  vec<Heap::handle_type> dropped;  // positions of sentences out of time.
+  while (!result->heap.empty()) {
+    if (steps % DEADLINE_CHECK_STEPS == 0 and std::chrono::steady_clock::now() >= deadline) break;
+    auto p = policy(result);
+    if (sentence_seconds > 0) {
+      auto start = std::chrono::steady_clock::now();
+      result->setNode(p.index, this->sampleOne(result, this->rng, p));
+      spent[p.index] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (spent[p.index] >= sentence_seconds) {
+        const GraphicalModel& gm = *result->getNode(p.index)->gm;
+        for (size_t pos = 0; pos < gm.size(); pos++) {
+          if (!result->heap.contains(gm.handle[pos]) or !result->heap.active(gm.handle[pos])) continue;
+          result->heap.erase(gm.handle[pos]);  // frozen positions stay frozen.
+          dropped.push_back(gm.handle[pos]);
+        }
+      }
+    } else {
+      result->setNode(p.index, this->sampleOne(result, this->rng, p));
+    }
+    steps++;
+  }
+  for (Heap::handle_type handle : dropped) result->heap.restore(handle);
+  return steps;
+}
+
+void BlockPolicy::freezeOrThaw(ptr<BlockPolicy::Result> result, MarkovTreeNodePtr node, int pos,
+                               int oldval, bool blanket_stable) {
+  GraphicalModel& gm = *node->gm;
+  bool ent_stable = fabs(gm.entropy[pos] - gm.prev_entropy[pos]) <= converge_ent;
+  gm.stable[pos] = blanket_stable and ent_stable ? gm.stable[pos] + 1 : 0;
+  if (gm.stable[pos] >= (int)freeze and result->heap.contains(gm.handle[pos])) {
+    result->heap.erase(gm.handle[pos]);
+  }
+  if (gm.getLabel(pos) == oldval) return;
+  for (auto id : model->invMarkovBlanket(gm, pos)) { // a neighbour changed: thaw.
+    Heap::handle_type handle = gm.handle[id];
+    if (!result->heap.contains(handle) or result->heap.active(handle)) continue;
+    gm.stable[id] = 0;
+    result->heap.restore(handle);
+  }
+}
+
+double BlockPolicy::cost(MarkovTreeNodePtr node, int id) {
+  if (node->gm->cost[id] > 0) return node->gm->cost[id];
+  return costs.estimate(costs.classOf(node->gm->blanket[id].size()));
+}
+
+double BlockPolicy::priority(MarkovTreeNodePtr node, int id) {
+  if (!cost_aware) return node->gm->resp[id];
+  // response is the log-odds that sampling id pays off, see train.
+  double seconds = this->cost(node, id);
+  return logisticFunc(node->gm->resp[id]) / (seconds > 0 ? seconds : 1);
+}
+
+
+void BlockPolicy::sampleTiled(BlockPolicy::ResultPtr result, double budget) {
+  vec<size_t> samples(result->size(), 0);
+  vec<std::tuple<MarkovTreeNodePtr, ptr<Tile>, size_t> > jobs;
+  for (size_t i = 0; i < result->size(); i++) {
+    MarkovTreeNodePtr node = result->getNode(i);
+    if (node->tiles.size() == 0) {
+      this->makeTiles(node, rng);
+      for (auto t : node->tiles) {
+        GraphicalModel& tile_gm = *t->node->gm;
+        for (int pos : t->interior) {
+          tile_gm.resp[pos] = 1e8 - t->global[pos]; // this is a hack.
+          tile_gm.handle[pos] = t->heap.push(Value(Location(i, pos), tile_gm.resp[pos]));
+        }
+      }
+    }
+    for (auto t : node->tiles) { // budget is split in proportion to tile interiors.
+      t->budget += budget * t->interior.size();
+      size_t steps = (size_t)t->budget;
+      t->budget -= steps;
+      samples[i] += steps;
+      jobs.push_back(std::make_tuple(node, t, steps));
+    }
+  }
+  parallel_for(*sweep_pool, 0, jobs.size(), [&] (int tid, size_t j) {
+    MarkovTreeNodePtr node = std::get<0>(jobs[j]);
+    Tile& t = *std::get<1>(jobs[j]);
+    this->pullHalo(t, *node->gm);
+    for (size_t s = 0; s < std::get<2>(jobs[j]); s++) {
+      int pos = t.heap.top().loc.pos;
+      t.node = Policy::sampleOne(t.node, t.rng, pos);
+      this->updateResp(t.node, t.rng, pos, &t.heap);
+    }
+  });
+  for (size_t i = 0; i < result->size(); i++) {
+    this->mergeTiles(result->getNode(i), samples[i]);
+  }
+}
+
+
+void BlockPolicy::sampleMultiQueue(BlockPolicy::ResultPtr result, size_t steps) {
+  std::atomic<size_t> taken(0);
+  size_t num_jobs = sweep_pool->numThreads(), num_shards = result->shards.size();
+  vec<double> wallclock_sample(num_jobs, 0), wallclock_policy(num_jobs, 0);
+  // clock() counts the CPU time of all threads, so each job times its own steps on steady_clock.
+  auto seconds = [] (std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+  parallel_for(*sweep_pool, 0, num_jobs, [&] (int tid, size_t j) {
+    objcokus& job_rng = sweep_pool->rngs[j];
+    while (taken++ < steps) {
+      /* pick the better top of two random shards. the top may change before
+       * the shard is locked, which only makes the choice approximate. */
+      auto clock_start = std::chrono::steady_clock::now();
+      size_t k = job_rng.randomMT() % num_shards, k2 = job_rng.randomMT() % num_shards;
+      auto top = [&] (size_t k) {
+        std::lock_guard<std::mutex> lock(result->shards[k]->mutex);
+        return result->shards[k]->heap.top().resp;
+      };
+      if (k2 != k and top(k2) > top(k)) k = k2;
+      Result::Shard& shard = *result->shards[k];
+      std::lock_guard<std::mutex> lock(shard.mutex); // also locks the sentences of the shard.
+      Location loc = shard.heap.top().loc;
+      wallclock_policy[j] += seconds(clock_start);
+
+      clock_start = std::chrono::steady_clock::now();
+      MarkovTreeNodePtr node = result->getNode(loc.index);
+      node->gm->rng = &job_rng;
+      node = Policy::sampleOne(node, job_rng, loc.pos);
+      result->setNode(loc.index, node);
+      wallclock_sample[j] += seconds(clock_start);
+      clock_start = std::chrono::steady_clock::now();
+      Policy::updateResp(node, job_rng, loc.pos, &shard.heap);
+      wallclock_policy[j] += seconds(clock_start);
+    }
+  });
+  for (size_t j = 0; j < num_jobs; j++) {
+    result->wallclock_sample += wallclock_sample[j];
+    result->wallclock_policy += wallclock_policy[j];
+  }
+}
+
 
 Location BlockPolicy::policy(BlockPolicy::ResultPtr result) {
-  clock_t clock_start = clock(), clock_end;
-  Location loc;
+  auto clock_start = std::chrono::steady_clock::now();
   Value val = result->heap.top();
-  clock_end = clock();
-  result->wallclock_policy += (double)(clock_end - clock_start) / CLOCKS_PER_SEC;
+  result->wallclock_policy += std::chrono::duration<double>(std::chrono::steady_clock::now() - clock_start).count();
   return val.loc;
 }
 
 
+/////////////////////////// Residual Policy ///////////////////////////////
+ResidualPolicy::ResidualPolicy(ModelPtr model, const variables_map& vm)
+  : BlockPolicy(model, vm),
+    residual(vm["residual"].empty() ? "ent-vary" : vm["residual"].as<string>()) {
+  if (residual != "kl" and residual != "ent-vary" and residual != "stale") {
+    throw "unrecognized residual.";
+  }
+}
+
+
+void ResidualPolicy::train(ptr<Corpus> corpus) {
+  lg->begin("train");
+  *lg << "residual " << residual << ", no training." << endl;
+  lg->end(); // </train>
+}
+
+
+MarkovTreeNodePtr ResidualPolicy::sampleOne(ptr<BlockPolicy::Result> result,
+    objcokus& rng,
+    const Location& loc) {
+  MarkovTreeNodePtr node = BlockPolicy::sampleOne(result, rng, loc);
+  vec<Heap::handle_type> dirty;
+  auto rerank = [&] (int id) {
+    Heap::handle_type handle = node->gm->handle[id];
+    if (node->gm->blanket[id].size() == 0 or !result->heap.contains(handle)) return; // not visited yet.
+    result->heap[handle].resp = this->priority(node, id);
+    dirty.push_back(handle);
+  };
+  /* updateResp ranked loc.pos before its blanket was taken, so its staleness
+   * was still that of the previous visit. */
+  rerank(loc.pos);
+  /* kl of a neighbour depends only on its own conditionals, which sampling loc.pos leaves alone. */
+  if (residual != "kl") {
+    for (auto id : model->invMarkovBlanket(*node->gm, loc.pos)) rerank(id);
+  }
+  result->heap.update_many(dirty.begin(), dirty.end());
+  return node;
+}
+
+
+double ResidualPolicy::priority(MarkovTreeNodePtr node, int id) {
+  GraphicalModel& gm = *node->gm;
+  double r = 0;
+  if (residual == "kl") {
+    const vec<double>& p = gm.this_sc[id], & q = gm.prev_sc[id];
+    if (p.size() != q.size()) { // first visit, no previous conditional.
+      r = log(gm.numLabels(id));
+    } else {
+      for (size_t c = 0; c < p.size(); c++) {
+        if (p[c] == -DBL_MAX) continue;
+        r += exp(p[c]) * (p[c] - q[c]);
+      }
+    }
+  } else if (residual == "ent-vary") {
+    for (const pair<int, int>& v : gm.vary[id]) r += v.second;
+    r *= gm.entropy[id];
+  } else { // stale: neighbours whose label changed since id was sampled.
+    for (const pair<int, int>& b : gm.blanket[id]) r += gm.getLabel(b.first) != b.second;
+  }
+  if (cost_aware) {
+    double seconds = this->cost(node, id);
+    return r / (seconds > 0 ? seconds : 1);
+  }
+  return r;
+}
+
+
+
 
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "recorder.h"
+
+using namespace std;
+
+namespace HeteroSampler {
+  template<class T>
+  static void writeRaw(ofstream& file, const T& value) {
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<class T>
+  static void writeColumn(ofstream& file, const vec<T>& column) {
+    if(column.size() > 0) file.write(reinterpret_cast<const char*>(&column[0]), column.size() * sizeof(T));
+  }
+
+  ExampleRecorder::ExampleRecorder(const string& path, size_t capacity, uint32 seed)
+  :path(path), capacity(max((size_t)1, capacity)), closed(false), num_seen(0), num_versions(0) {
+    rng.seedMT(seed);
+    param_file.open(path + ".param", ios::binary | ios::trunc);
+    if(!param_file.is_open()) throw "failed to open the example recorder.";
+  }
+
+  ExampleRecorder::~ExampleRecorder() {
+    this->close();
+  }
+
+  int ExampleRecorder::intern(const string& name) {
+    auto it = name_id.find(name);
+    if(it != name_id.end()) return it->second;
+    name_id[name] = names.size();
+    names.push_back(name);
+    return names.size() - 1;
+  }
+
+  void ExampleRecorder::writeDelta(const string& key, double value) {
+    writeRaw(param_file, num_versions);
+    writeRaw(param_file, (int32_t)intern(key));
+    writeRaw(param_file, value);
+  }
+
+  void ExampleRecorder::start(ParamPointer param) {
+    std::lock_guard<std::mutex> lock(rec_mutex);
+    for(const ParamItem& p : *param) {
+      writeDelta(p.first, p.second);
+    }
+  }
+
+  void ExampleRecorder::commit(ParamPointer delta, ParamPointer param) {
+    std::lock_guard<std::mutex> lock(rec_mutex);
+    num_versions++;
+    for(const ParamItem& p : *delta) {
+      writeDelta(p.first, getParam(param, p.first));
+    }
+  }
+
+  void ExampleRecorder::record(double reward, double resp, double staleness, const Instance* instance,
+                               int choice, int oldval, int newval, FeaturePointer feat) {
+    std::lock_guard<std::mutex> lock(rec_mutex);
+    num_seen++;
+    size_t slot = this->reward.size();
+    if(slot >= capacity) { // reservoir sampling: keep the example with probability capacity / seen.
+      uint64_t r = ((uint64_t)rng.randomMT() << 32) | (uint64_t)rng.randomMT();
+      slot = r % num_seen;
+      if(slot >= capacity) return;
+    }else{
+      this->reward.push_back(0);
+      this->resp.push_back(0);
+      this->staleness.push_back(0);
+      this->versions.push_back(0);
+      this->instances.push_back(0);
+      this->choice.push_back(0);
+      this->oldval.push_back(0);
+      this->newval.push_back(0);
+      this->feat.emplace_back();
+    }
+    auto id = instance_id.find(instance);
+    if(id == instance_id.end()) id = instance_id.insert(make_pair(instance, (uint64_t)instance_id.size())).first;
+    this->reward[slot] = reward;
+    this->resp[slot] = resp;
+    this->staleness[slot] = staleness;
+    this->versions[slot] = num_versions;
+    this->instances[slot] = id->second;
+    this->choice[slot] = choice;
+    this->oldval[slot] = oldval;
+    this->newval[slot] = newval;
+    this->feat[slot].clear();
+    for(const pair<string, double>& p : *feat) {
+      this->feat[slot].push_back(make_pair((int32_t)intern(p.first), p.second));
+    }
+  }
+
+  void ExampleRecorder::close() {
+    std::lock_guard<std::mutex> lock(rec_mutex);
+    if(closed) return;
+    closed = true;
+    param_file.close();
+    ofstream file(path, ios::binary | ios::trunc);
+    if(!file.is_open()) throw "failed to write the recorded examples.";
+    file.write("HSREC1", 6);
+    writeRaw(file, (uint64_t)reward.size());
+    writeColumn(file, reward);
+    writeColumn(file, resp);
+    writeColumn(file, staleness);
+    writeColumn(file, versions);
+    writeColumn(file, instances);
+    writeColumn(file, choice);
+    writeColumn(file, oldval);
+    writeColumn(file, newval);
+    uint64_t begin = 0;
+    writeRaw(file, begin);
+    for(const auto& f : feat) {
+      begin += f.size();
+      writeRaw(file, begin);
+    }
+    for(const auto& f : feat) {
+      for(const auto& p : f) writeRaw(file, p.first);
+    }
+    for(const auto& f : feat) {
+      for(const auto& p : f) writeRaw(file, p.second);
+    }
+    writeRaw(file, (uint64_t)names.size());
+    for(const string& name : names) {
+      writeRaw(file, (uint32_t)name.size());
+      file.write(name.data(), name.size());
+    }
+  }
+}
@@ -0,0 +1,153 @@
+#include "shard.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace HeteroSampler {
+  ShardChannel::ShardChannel(int fd)
+  :fd(fd) {
+  }
+
+  ShardChannel::~ShardChannel() {
+    if(fd >= 0) close(fd);
+  }
+
+  void ShardChannel::send(const vec<string>& fields) {
+    string line = boost::algorithm::join(fields, "\t") + "\n";
+    size_t sent = 0;
+    while(sent < line.size()) {
+      ssize_t n = write(fd, line.data() + sent, line.size() - sent);
+      if(n < 0 and errno == EINTR) continue;
+      if(n <= 0) throw "shard channel closed.";
+      sent += n;
+    }
+  }
+
+  bool ShardChannel::recv(vec<string>& fields) {
+    size_t end;
+    while((end = buffer.find('\n')) == string::npos) {
+      char chunk[4096];
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if(n < 0 and errno == EINTR) continue;
+      if(n <= 0) return false;
+      buffer.append(chunk, n);
+    }
+    string line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    boost::split(fields, line, boost::is_any_of("\t"));
+    return true;
+  }
+
+  vec<string> ShardStats::fields() const {
+    return {tostr(hit_count), tostr(pred_count), tostr(truth_count),
+            tostr(time), tostr(wallclock), tostr(count)};
+  }
+
+  ShardStats ShardStats::parse(const vec<string>& fields) {
+    if(fields.size() != 6) throw "malformed shard stats.";
+    ShardStats stats;
+    stats.hit_count = stod(fields[0]);
+    stats.pred_count = stod(fields[1]);
+    stats.truth_count = stod(fields[2]);
+    stats.time = stod(fields[3]);
+    stats.wallclock = stod(fields[4]);
+    stats.count = stoul(fields[5]);
+    return stats;
+  }
+
+  ShardPool::ShardPool(size_t num_shards, std::function<void(size_t, ShardChannel&)> worker) {
+    cout.flush();
+    for(size_t s = 0; s < num_shards; s++) {
+      int fds[2];
+      if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) throw "failed to create shard socket.";
+      pid_t pid = fork();
+      if(pid < 0) throw "failed to fork shard worker.";
+      if(pid == 0) { // worker: drop the coordinator's ends, run, and exit without unwinding.
+        close(fds[0]);
+        for(auto channel : channels) {
+          close(channel->fd);
+          channel->fd = -1;
+        }
+        int status = 0;
+        try {
+          ShardChannel channel(fds[1]);
+          worker(s, channel);
+        } catch(const char* ee) {
+          cout << "error (shard " << s << "): " << ee << endl;
+          status = 1;
+        }
+        cout.flush();
+        _exit(status);
+      }
+      close(fds[1]);
+      channels.push_back(std::make_shared<ShardChannel>(fds[0]));
+      pids.push_back(pid);
+    }
+  }
+
+  ShardPool::~ShardPool() {
+    channels.clear(); // workers see the end of stream.
+    for(pid_t pid : pids) {
+      int status;
+      waitpid(pid, &status, 0);
+    }
+  }
+
+  void ShardPool::broadcast(const vec<string>& fields) {
+    for(auto channel : channels) {
+      channel->send(fields);
+    }
+  }
+
+  vec<vec<string> > ShardPool::gather() {
+    vec<vec<string> > ret(channels.size());
+    for(size_t s = 0; s < channels.size(); s++) {
+      if(!channels[s]->recv(ret[s])) throw "shard worker exited.";
+    }
+    return ret;
+  }
+
+  void shardCorpus(ptr<Corpus> corpus, size_t shard, size_t num_shards, size_t test_count) {
+    vec<SentencePtr> seqs;
+    for(size_t i = shard; i < corpus->seqs.size() and i < test_count; i += num_shards) {
+      seqs.push_back(corpus->seqs[i]);
+    }
+    corpus->seqs = seqs;
+  }
+
+  void logShardSummary(XMLlog& lg, const vec<ShardStats>& stats, Model::Scoring scoring) {
+    ShardStats total;
+    double time = 0;
+    for(const ShardStats& s : stats) {
+      total.hit_count += s.hit_count;
+      total.pred_count += s.pred_count;
+      total.truth_count += s.truth_count;
+      total.count += s.count;
+      time += s.time * s.count;
+      total.wallclock = max(total.wallclock, s.wallclock);  // shards run side by side.
+    }
+    total.time = total.count > 0 ? time / total.count : 0;
+    double accuracy = total.hit_count / total.pred_count;
+    double recall = total.hit_count / total.truth_count;
+    lg.begin("test");
+    lg.begin("shards");
+    lg << stats.size() << endl;
+    lg.end(); // </shards>
+    lg.begin("time");
+    lg << total.time << endl;
+    lg.end(); // </time>
+    lg.begin("wallclock");
+    lg << total.wallclock << endl;
+    lg.end(); // </wallclock>
+    lg.begin("accuracy");
+    if(scoring == Model::SCORING_NER) {
+      lg << 2 * accuracy * recall / (accuracy + recall) << endl;
+    }else{
+      lg << accuracy << endl;
+    }
+    lg.end(); // </accuracy>
+    lg.end(); // </test>
+  }
+}
@@ -0,0 +1,13 @@
+import sys, os
+from test import *
+import unittest
+
+class TestEval(unittest.TestCase):
+    def test_eval_table(self):
+        cmd = "./check/check-eval data/eng_ner/test_small"
+        print cmd
+        line = execute(cmd)
+        assert(line.strip() == "ok")
+
+if __name__ == "__main__":
+    unittest.main()
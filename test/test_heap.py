@@ -0,0 +1,13 @@
+import sys, os
+from test import *
+import unittest
+
+class TestHeap(unittest.TestCase):
+    def test_indexed_heap(self):
+        cmd = "./check/check-heap"
+        print cmd
+        line = execute(cmd)
+        assert(line.strip() == "ok")
+
+if __name__ == "__main__":
+    unittest.main()
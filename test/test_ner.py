@@ -21,6 +21,15 @@ class TestNER(unittest.TestCase):
         line = execute("cat result/eng_ner/gibbs_small/T4.xml | grep '<accuracy>' -A 1 | tail -n 1")
         assert(float(line) >= 0.5)
 
+    def test_small_gibbs_policy_marginal(self):
+        cmd = "./bin/policy --type tagging --policy gibbs --output result/eng_ner/gibbs_small_marginal  " + \
+                    "--model  model/eng_ner/gibbs_small.model --train  data/eng_ner/train_small " + \
+                    "--test data/eng_ner/test_small --eta 1 --T 6 --decode mbr --log log/eng_ner/gibbs_small_marginal"
+        print cmd
+        execute(cmd)
+        line = execute("cat result/eng_ner/gibbs_small_marginal/T4.xml | grep '<accuracy>' -A 1 | tail -n 1")
+        assert(float(line) >= 0.5)
+
     def test_small_adaptive_policy(self):
             cmd = "./bin/policy --type tagging --policy adaptive --output result/eng_ner/adaptive_small  " + \
                         "--model  model/eng_ner/gibbs_small.model --train  data/eng_ner/train_small " + \
@@ -7,6 +7,7 @@
 #include "model_opengm.h"
 #include "utils.h"
 #include "policy.h"
+#include "shard.h"
 #include "opengm.h"
 
 #include <boost/format.hpp>
@@ -41,7 +42,7 @@ int main(int argc, char* argv[]) {
     ("train", po::value<string>()->default_value("data/eng_ner/train"), "training data")
     ("test", po::value<string>()->default_value("data/eng_ner/test"), "test data")
     // learning
-    ("policy", po::value<string>()->default_value("gibbs"), "the policy used for sampling (gibbs / adaptive)")
+    ("policy", po::value<string>()->default_value("gibbs"), "the policy used for sampling (gibbs / adaptive / residual)")
     ("learning", po::value<string>()->default_value("logistic"), "learning strategy (logistic / nn)")
     ("T", po::value<size_t>()->default_value(4), "number of sweeps by the policy")
     ("K", po::value<size_t>()->default_value(1), "number of trajectories")
@@ -50,9 +51,29 @@ int main(int argc, char* argv[]) {
     ("trainCount", po::value<size_t>()->default_value(-1), "how many training data used ? default: all (-1). ")
     ("Q", po::value<size_t>()->default_value(1), "number of passes")
     ("numThreads", po::value<size_t>()->default_value(1), "number of threads to use")
+    ("schedule", po::value<string>()->default_value("fifo"), "order in which test sentences are handed to threads: fifo / longest (longest first)")
+    ("multiqueue", po::value<size_t>()->default_value(0), "adaptive policy: sample with numThreads threads over multiqueue x numThreads heaps of sentences (0 = one global heap)")
+    ("interleave", po::value<size_t>()->default_value(1), "test: number of chains each thread advances in turn, to overlap their memory stalls")
+    ("shards", po::value<size_t>()->default_value(1), "test: split the test corpus over this many worker processes, merged by this process")
+    ("residual", po::value<string>()->default_value("ent-vary"), "residual policy: kl / ent-vary / stale")
+    ("deadline", po::value<double>()->default_value(0), "adaptive policy: seconds of wall clock per unit of budget, instead of samples per token (0 = off)")
+    ("deadline_scope", po::value<string>()->default_value("corpus"), "deadline is per corpus / sentence")
+    ("freeze", po::value<size_t>()->default_value(0), "adaptive policy: remove a position from the heap after this many stable visits, until a neighbour changes (0 = never)")
+    ("cost_aware", po::value<bool>()->default_value(false), "adaptive policy: rank positions by expected gain per measured CPU cost, charge the budget in estimated seconds")
+    ("numa", po::value<bool>()->default_value(false), "test: pin threads to NUMA nodes, replicate model weights per node and report per-node throughput")
+    ("lockstep", po::value<bool>()->default_value(false), "converge: advance the K-1 auxiliary chains of a sentence in lockstep")
     ("inplace", po::value<bool>()->default_value(true), "set inplace = false causes the sampler to represent entire trajectory")
     ("lets_lazymax", po::value<bool>()->default_value(false), "lazymax is true, the algorithm takes max sample only after each sweep.")
     ("init", po::value<string>()->default_value("random"), "initialization method: random, iid, unigram.")
+    ("converge", po::value<bool>()->default_value(false), "gibbs policy: stop each chain early once converged")
+    ("converge_change", po::value<double>()->default_value(0), "convergence: max fraction of labels changed in the last sweep")
+    ("converge_ent", po::value<double>()->default_value(0.01), "convergence: max mean entropy change in the last sweep")
+    ("converge_rhat", po::value<double>()->default_value(1.1), "convergence: max R-hat over K chains (only if K > 1)")
+    ("learn_stop", po::value<bool>()->default_value(false), "gibbs policy: stop each chain by a stop rule trained on the training corpus")
+    ("sweep", po::value<string>()->default_value("sequential"), "gibbs policy: sequential / chromatic (colour classes of a sweep are sampled in parallel over numThreads) / hogwild (asynchronous, stale neighbor labels allowed) / tiled (ising: tiles with halos sampled in parallel, also for the adaptive policy)")
+    ("tile", po::value<int>()->default_value(32), "side length of tiles for --sweep tiled")
+    ("icm", po::value<double>()->default_value(-1), "after icm * T visits to a position, its kernel takes the argmax label (ICM). -1: always sample")
+    ("decode", po::value<string>()->default_value("max"), "final prediction: max (best sample), marginal (max marginals), mbr (max expected token hits over transitions seen in training; token-level, not chunk-level, also for NER)")
     ("feat", po::value<std::string>()->default_value(""), "list of meta-features to use, separated with space")
     // simulated annealing
     ("temp", po::value<string>()->default_value(""), "the annealing scheme to use (\"scanline\" or \"\")")
@@ -69,6 +90,9 @@ int main(int argc, char* argv[]) {
     // other options
     ("verbose", po::value<bool>()->default_value(false), "whether to output more debug information")
     ("verbosity", po::value<string>()->default_value(""), "what kind of information to log? ")
+    ("sync_every", po::value<size_t>()->default_value(0), "train: sample this many sentences in parallel over numThreads, then merge the gradients of each thread into the policy (0 = update the policy at every step)")
+    ("record", po::value<string>()->default_value(""), "adaptive policy: record a sample of the policy training examples to this file (binary, see recorder.h)")
+    ("record_size", po::value<size_t>()->default_value(100000), "number of training examples kept by --record")
     ("lets_notrain", po::value<bool>()->default_value(false), "do not train the policy")
     ;
 
@@ -162,11 +186,98 @@ int main(int argc, char* argv[]) {
     removeFile(name);
     makeDirs(name + "/");
 
-    if (vm["policy"].as<string>() == "gibbs")
+    // sharded test: workers are forked before any policy starts its threads.
+    const size_t num_shards = vm["shards"].as<size_t>();
+    ptr<ShardPool> shards;
+    if (num_shards > 1) {
+      shards = std::make_shared<ShardPool>(num_shards, [&] (size_t s, ShardChannel& channel) {
+        shardCorpus(test_corpus, s, num_shards, vm["testCount"].as<size_t>());
+        po::variables_map shard_vm = vm;
+        shard_vm.at("log").value() = boost::any(vm["log"].as<string>() + ".shard" + to_string(s));
+        ptr<Policy> policy;
+        if (vm["policy"].as<string>() == "gibbs") {
+          policy = std::make_shared<GibbsPolicy>(model, shard_vm);
+          cast<GibbsPolicy>(policy)->T = 1;
+        } else if (vm["policy"].as<string>() == "residual") {
+          policy = std::make_shared<ResidualPolicy>(model, shard_vm);
+          policy->model_unigram = model_unigram;
+        } else {
+          policy = std::make_shared<BlockPolicy>(model, shard_vm);
+          policy->model_unigram = model_unigram;
+        }
+        Policy::ResultPtr result = nullptr;
+        vec<string> cmd;
+        while (channel.recv(cmd)) {
+          if (cmd[0] == "param") { // param <key> <value>: the coordinator's trained policy.
+            (*policy->param)[cmd[1]] = stod(cmd[2]);
+            continue;
+          }
+          // test <budget> <log>: run the next test of the shard, log to <log>.shard<s>.xml.
+          double budget = stod(cmd[1]);
+          if (cmd[2] != "") {
+            policy->resetLog(std::make_shared<XMLlog>(cmd[2] + ".shard" + to_string(s) + ".xml"));
+          }
+          if (isinstance<BlockPolicy>(policy)) {
+            auto block_policy = cast<BlockPolicy>(policy);
+            if (result == nullptr) {
+              result = block_policy->test(test_corpus, budget);
+            } else {
+              block_policy->test(static_pointer_cast<BlockPolicy::Result>(result), budget);
+            }
+          } else if (result == nullptr) {
+            result = policy->test(test_corpus);
+          } else {
+            policy->init_method = "";
+            policy->test(result);
+          }
+          policy->resetLog(nullptr);
+          ShardStats stats;
+          stats.hit_count = result->hit_count;
+          stats.pred_count = result->pred_count;
+          stats.truth_count = result->truth_count;
+          stats.time = result->time;
+          stats.wallclock = result->wallclock;
+          stats.count = result->size();
+          channel.send(stats.fields());
+        }
+      });
+    }
+    // run the next test on all shards, and log the merged summary to <myname>.xml.
+    auto testShards = [&] (double budget, string myname) {
+      shards->broadcast({"test", boost::str(boost::format("%.17g") % budget), myname});
+      vec<ShardStats> stats;
+      for (const vec<string>& fields : shards->gather()) {
+        stats.push_back(ShardStats::parse(fields));
+      }
+      if (myname != "") {
+        XMLlog lg(myname + ".xml");
+        logShardSummary(lg, stats, model->scoring);
+      }
+    };
+
+    if (vm["policy"].as<string>() == "gibbs" and shards != nullptr)
+    {
+      if (vm["learn_stop"].as<bool>()) { // train the stop rule here, and send it to the shards.
+        GibbsPolicy gibbs_policy(model, vm);
+        gibbs_policy.resetLog(std::make_shared<XMLlog>(name + "_train.xml"));
+        gibbs_policy.train(corpus);
+        for (const ParamItem& p : *gibbs_policy.param) {
+          shards->broadcast({"param", p.first, boost::str(boost::format("%.17g") % p.second)});
+        }
+      }
+      for (size_t t = 1; t <= T; t++) {
+        testShards(1, name + "/T" + to_string(t));
+      }
+    }
+    else if (vm["policy"].as<string>() == "gibbs")
     {
       Policy::ResultPtr result = nullptr;
       shared_ptr<GibbsPolicy> gibbs_policy;
       gibbs_policy = shared_ptr<GibbsPolicy>(new GibbsPolicy(model, vm));
+      if (vm["learn_stop"].as<bool>()) { // training chains run all T sweeps.
+        gibbs_policy->resetLog(std::make_shared<XMLlog>(name + "_train.xml"));
+        gibbs_policy->train(corpus);
+      }
       gibbs_policy->T = 1;  // do one sweep after another.
       for (size_t t = 1; t <= T; t++) {
         string myname = name + "/T" + to_string(t) + ".xml";
@@ -179,10 +290,15 @@ int main(int argc, char* argv[]) {
         }
       }
     }
-    else if (vm["policy"].as<string>() == "adaptive")
+    else if (vm["policy"].as<string>() == "adaptive" or vm["policy"].as<string>() == "residual")
     {
       const int fold = 20;
-      auto policy = std::make_shared<BlockPolicy>(model, vm);
+      ptr<BlockPolicy> policy;
+      if (vm["policy"].as<string>() == "residual") {
+        policy = std::make_shared<ResidualPolicy>(model, vm);
+      } else {
+        policy = std::make_shared<BlockPolicy>(model, vm);
+      }
       policy->model_unigram = model_unigram;
 
       // training
@@ -191,15 +307,28 @@ int main(int argc, char* argv[]) {
       policy->train(corpus);
       int testCount = vm["testCount"].as<size_t>();
       int count = test_corpus->count(testCount);
-      auto result = policy->test(test_corpus, 0);
+      BlockPolicy::ResultPtr result;
+      if (shards != nullptr) {
+        for (const ParamItem& p : *policy->param) {
+          shards->broadcast({"param", p.first, boost::str(boost::format("%.17g") % p.second)});
+        }
+        testShards(0, "");
+      } else {
+        result = policy->test(test_corpus, 0);
+      }
       policy->resetLog(nullptr);
 
-      // run with different budgets
+      // run with different budgets: each shard gets b per token of its own sentences,
+      // so the shards split the global budget in proportion to their size.
       double budget = 0;
       auto runWithBudget = [&] (double b) {
         budget += b;
-        string myname = name + "/b" + boost::str(boost::format("%.2f") % budget) + ".xml";
-        policy->resetLog(shared_ptr<XMLlog>(new XMLlog(myname)));
+        string myname = name + "/b" + boost::str(boost::format("%.2f") % budget);
+        if (shards != nullptr) {
+          testShards(b, myname);
+          return;
+        }
+        policy->resetLog(shared_ptr<XMLlog>(new XMLlog(myname + ".xml")));
         policy->test(result, b);
         policy->resetLog(nullptr);
       };